@@ -0,0 +1,320 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Brightness write coalescing and ramps, shared by the ak3a and ak3b drivers.
+ *
+ * Unless noted otherwise, the caller must hold mode_lock.
+ *
+ * Copyright (c) 2023 Google LLC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _PANEL_GOOGLE_AK3_BRIGHTNESS_H_
+#define _PANEL_GOOGLE_AK3_BRIGHTNESS_H_
+
+#include <linux/workqueue.h>
+
+#include "include/trace/dpu_trace.h"
+#include "panel/panel-samsung-drv.h"
+
+/*
+ * Frames the DDIC takes for a hardware dimming transition. The driver doesn't
+ * program the dimming speed, this is an upper bound of the DDIC default: a
+ * faster transition settles before the next step, while a slower one would be
+ * cut short by the next step or by turning the dimming off.
+ */
+#define AK3_HW_DIMMING_FRAMES 32
+#define AK3_RAMP_STEPS_MAX 64
+
+/**
+ * struct ak3_brightness_funcs - panel specific brightness hooks
+ * @write: write a DBV to the panel
+ * @update_wrctrld: write WRCTRLD after the dimming of the ramp changed
+ */
+struct ak3_brightness_funcs {
+	int (*write)(struct exynos_panel *ctx, u16 br);
+	void (*update_wrctrld)(struct exynos_panel *ctx);
+};
+
+/**
+ * struct ak3_brightness_ramp - brightness transition run by the driver
+ * @work: writes the next step
+ * @start: DBV at the start of the ramp
+ * @target: DBV at the end of the ramp
+ * @step: number of steps written
+ * @num_steps: number of steps of the ramp
+ * @interval_ms: time between steps
+ * @hw_ms: time the panel dimming takes to reach a step
+ * @hw_dimming: whether the panel dimming smooths out each step, otherwise the
+ *              steps are written right after vsync
+ * @active: whether the ramp runs, protected by mode_lock
+ */
+struct ak3_brightness_ramp {
+	struct delayed_work work;
+	u16 start;
+	u16 target;
+	u16 step;
+	u16 num_steps;
+	u32 interval_ms;
+	u32 hw_ms;
+	bool hw_dimming;
+	bool active;
+};
+
+/**
+ * struct ak3_brightness - brightness writes run by the driver
+ * @ctx: panel struct
+ * @funcs: panel specific hooks
+ * @coalesce: write at most one brightness update per frame
+ * @pending: latest brightness not written yet, protected by mode_lock
+ * @pending_valid: whether @pending needs to be written
+ * @last: last brightness written to the panel
+ * @work: writes @pending at the next vsync
+ * @ramp: brightness ramp in progress
+ */
+struct ak3_brightness {
+	struct exynos_panel *ctx;
+	const struct ak3_brightness_funcs *funcs;
+	bool coalesce;
+	u16 pending;
+	bool pending_valid;
+	u16 last;
+	struct work_struct work;
+	struct ak3_brightness_ramp ramp;
+};
+
+static inline int ak3_brightness_write(struct ak3_brightness *brt, u16 br)
+{
+	int ret = brt->funcs->write(brt->ctx, br);
+
+	if (!ret)
+		brt->last = br;
+
+	return ret;
+}
+
+static inline bool ak3_brightness_crosses_hbm(struct ak3_brightness *brt, u16 br)
+{
+	const u32 normal_max = brt->ctx->desc->brt_capability->normal.level.max;
+
+	return (br > normal_max) != (brt->last > normal_max);
+}
+
+/* write the pending brightness if any */
+static inline void ak3_brightness_flush(struct ak3_brightness *brt)
+{
+	if (!brt->pending_valid)
+		return;
+
+	brt->pending_valid = false;
+	ak3_brightness_write(brt, brt->pending);
+}
+
+static inline void ak3_brightness_wait_vsync(struct exynos_panel *ctx,
+					     const struct exynos_panel_mode *pmode)
+{
+	DPU_ATRACE_BEGIN("ak3_brightness_wait_vsync");
+	exynos_panel_wait_for_vsync_done(ctx, pmode->exynos_mode.te_usec,
+		EXYNOS_VREFRESH_TO_PERIOD_USEC(drm_mode_vrefresh(&pmode->mode)));
+	DPU_ATRACE_END("ak3_brightness_wait_vsync");
+}
+
+/*
+ * Brightness updates coalesced within a frame are written right after the next
+ * vsync, so that only the latest one goes out and it doesn't contend with the
+ * frame transfer.
+ */
+static inline void ak3_brightness_work(struct work_struct *work)
+{
+	struct ak3_brightness *brt = container_of(work, struct ak3_brightness, work);
+	struct exynos_panel *ctx = brt->ctx;
+	const struct exynos_panel_mode *pmode = ctx->current_mode;
+
+	if (pmode)
+		ak3_brightness_wait_vsync(ctx, pmode);
+
+	mutex_lock(&ctx->mode_lock);
+	pmode = ctx->current_mode;
+	/* binned LP brightness is handled synchronously */
+	if (is_panel_active(ctx) && pmode && !pmode->exynos_mode.is_lp_mode)
+		ak3_brightness_flush(brt);
+	else
+		brt->pending_valid = false;
+	mutex_unlock(&ctx->mode_lock);
+}
+
+/* stop the brightness ramp */
+static inline void ak3_ramp_stop(struct ak3_brightness *brt)
+{
+	struct ak3_brightness_ramp *ramp = &brt->ramp;
+
+	ramp->active = false;
+	if (ramp->hw_dimming) {
+		ramp->hw_dimming = false;
+		if (is_panel_active(brt->ctx))
+			brt->funcs->update_wrctrld(brt->ctx);
+	}
+}
+
+static inline void ak3_ramp_work(struct work_struct *work)
+{
+	struct ak3_brightness_ramp *ramp = container_of(to_delayed_work(work),
+						      struct ak3_brightness_ramp, work);
+	struct ak3_brightness *brt = container_of(ramp, struct ak3_brightness, ramp);
+	struct exynos_panel *ctx = brt->ctx;
+	const struct exynos_panel_mode *pmode = ctx->current_mode;
+	int delta;
+	u16 dbv;
+
+	if (!ramp->hw_dimming && pmode)
+		ak3_brightness_wait_vsync(ctx, pmode);
+
+	mutex_lock(&ctx->mode_lock);
+	pmode = ctx->current_mode;
+	if (!ramp->active || !is_panel_active(ctx) || !pmode || pmode->exynos_mode.is_lp_mode) {
+		ak3_ramp_stop(brt);
+		goto out;
+	}
+
+	/* the panel dimming reached the last step */
+	if (ramp->step == ramp->num_steps) {
+		ak3_ramp_stop(brt);
+		goto out;
+	}
+
+	ramp->step++;
+	delta = (int)ramp->target - ramp->start;
+	dbv = ramp->start + delta * ramp->step / ramp->num_steps;
+	/* report the target once reached, update_lock is taken before mode_lock */
+	if (!ak3_brightness_write(brt, dbv) && ramp->step == ramp->num_steps && ctx->bl)
+		ctx->bl->props.brightness = dbv;
+
+	if (ramp->step < ramp->num_steps)
+		schedule_delayed_work(&ramp->work, msecs_to_jiffies(ramp->interval_ms));
+	else if (ramp->hw_dimming)
+		/* keep dimming on for the last step, stop once it has settled */
+		schedule_delayed_work(&ramp->work, msecs_to_jiffies(ramp->hw_ms));
+	else
+		ak3_ramp_stop(brt);
+out:
+	mutex_unlock(&ctx->mode_lock);
+}
+
+/**
+ * ak3_ramp_start() - ramp the brightness to a target
+ * @brt: brightness state
+ * @target: target DBV
+ * @duration_ms: duration of the ramp
+ *
+ * Plan the least number of DBV steps for the transition. Steps use the panel
+ * dimming, which interpolates over AK3_HW_DIMMING_FRAMES, if the ramp is long
+ * enough and stays within the normal or the HBM range. Otherwise each step is
+ * written right after vsync, at most one per frame. The backlight brightness is
+ * updated to @target when the last step is written.
+ *
+ * Return: 0 on success, -EINVAL if the target is out of the range of the current
+ * HBM mode or -EBUSY if the panel can't ramp in its current state.
+ */
+static inline int ak3_ramp_start(struct ak3_brightness *brt, u16 target, u32 duration_ms)
+{
+	struct exynos_panel *ctx = brt->ctx;
+	struct ak3_brightness_ramp *ramp = &brt->ramp;
+	const struct exynos_panel_mode *pmode = ctx->current_mode;
+	const struct brightness_capability *cap = ctx->desc->brt_capability;
+	const struct brightness_attribute *range;
+	u32 frame_ms, hw_ms, steps, delta;
+
+	/* the ramp doesn't change the HBM mode, the DBV must stay within its range */
+	range = IS_HBM_ON(ctx->hbm_mode) ? &cap->hbm : &cap->normal;
+	if (target < range->level.min || target > range->level.max)
+		return -EINVAL;
+
+	if (!is_panel_active(ctx) || !pmode || pmode->exynos_mode.is_lp_mode ||
+	    ctx->hbm.local_hbm.enabled)
+		return -EBUSY;
+
+	ak3_brightness_flush(brt);
+	ak3_ramp_stop(brt);
+
+	frame_ms = DIV_ROUND_UP(EXYNOS_VREFRESH_TO_PERIOD_USEC(drm_mode_vrefresh(&pmode->mode)),
+				USEC_PER_MSEC);
+	hw_ms = frame_ms * AK3_HW_DIMMING_FRAMES;
+	delta = abs((int)target - brt->last);
+	if (!delta)
+		return 0;
+
+	ramp->hw_dimming = duration_ms >= hw_ms && !ak3_brightness_crosses_hbm(brt, target);
+	steps = duration_ms / (ramp->hw_dimming ? hw_ms : frame_ms);
+	steps = clamp_val(steps, 1, min_t(u32, delta, AK3_RAMP_STEPS_MAX));
+
+	ramp->start = brt->last;
+	ramp->target = target;
+	ramp->step = 0;
+	ramp->num_steps = steps;
+	ramp->interval_ms = duration_ms / steps;
+	ramp->hw_ms = hw_ms;
+	ramp->active = true;
+
+	dev_dbg(ctx->dev, "%s: %u -> %u in %ums, %u steps with %s\n", __func__,
+		ramp->start, target, duration_ms, steps,
+		ramp->hw_dimming ? "hw dimming" : "vsync aligned writes");
+
+	if (ramp->hw_dimming)
+		brt->funcs->update_wrctrld(ctx);
+	schedule_delayed_work(&ramp->work, 0);
+
+	return 0;
+}
+
+/**
+ * ak3_brightness_set() - write or coalesce a brightness request
+ * @brt: brightness state
+ * @br: DBV
+ *
+ * An explicit request stops the ramp in progress.
+ *
+ * Return: 0 on success or the error of the write.
+ */
+static inline int ak3_brightness_set(struct ak3_brightness *brt, u16 br)
+{
+	if (brt->ramp.active)
+		ak3_ramp_stop(brt);
+
+	/*
+	 * Crossing the HBM boundary is written right away so that the DBV change isn't
+	 * reordered with the HBM mode change, this also replaces any pending value.
+	 */
+	if (!brt->coalesce || !is_panel_active(brt->ctx) || ak3_brightness_crosses_hbm(brt, br)) {
+		brt->pending_valid = false;
+		return ak3_brightness_write(brt, br);
+	}
+
+	brt->pending = br;
+	brt->pending_valid = true;
+	schedule_work(&brt->work);
+
+	return 0;
+}
+
+static inline void ak3_brightness_init(struct ak3_brightness *brt, struct exynos_panel *ctx,
+				       const struct ak3_brightness_funcs *funcs)
+{
+	brt->ctx = ctx;
+	brt->funcs = funcs;
+	INIT_WORK(&brt->work, ak3_brightness_work);
+	INIT_DELAYED_WORK(&brt->ramp.work, ak3_ramp_work);
+}
+
+/* drop the pending write and the ramp, the caller must not hold mode_lock */
+static inline void ak3_brightness_cancel(struct ak3_brightness *brt)
+{
+	cancel_work_sync(&brt->work);
+	brt->pending_valid = false;
+	cancel_delayed_work_sync(&brt->ramp.work);
+	brt->ramp.active = false;
+	brt->ramp.hw_dimming = false;
+}
+
+#endif /* _PANEL_GOOGLE_AK3_BRIGHTNESS_H_ */
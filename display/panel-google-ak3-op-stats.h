@@ -0,0 +1,129 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Statistics per panel operation, shared by the ak3a and ak3b drivers.
+ *
+ * Operations are accounted at their begin/end boundary, where the driver
+ * already emits DPU trace markers. The DSI transfers of an operation are
+ * the ones inside its trace span.
+ *
+ * Copyright (c) 2023 Google LLC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _PANEL_GOOGLE_AK3_OP_STATS_H_
+#define _PANEL_GOOGLE_AK3_OP_STATS_H_
+
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/seq_file.h>
+#include <linux/spinlock.h>
+
+#include "include/trace/dpu_trace.h"
+
+/* bucket 0 is below 1us, bucket n covers [2^(n-1), 2^n) us, the last one is open */
+#define AK3_OP_HIST_BUCKETS 16
+
+/**
+ * struct ak3_op_stat - statistics of a panel operation
+ * @count: number of times the operation ran
+ * @total_us: accumulated wall time
+ * @max_us: longest wall time
+ * @hist: log2 histogram of the wall time in us
+ */
+struct ak3_op_stat {
+	u64 count;
+	u64 total_us;
+	u32 max_us;
+	u32 hist[AK3_OP_HIST_BUCKETS];
+};
+
+/**
+ * struct ak3_op_stats - statistics of all operations of a panel
+ * @names: operation names, also used as trace tags
+ * @stats: statistics per operation, protected by @lock. Wall time of nested
+ *         operations is also included in the outer one.
+ * @num_ops: number of entries in @names and @stats
+ * @lock: protects @stats
+ */
+struct ak3_op_stats {
+	const char * const *names;
+	struct ak3_op_stat *stats;
+	int num_ops;
+	spinlock_t lock;
+};
+
+/**
+ * struct ak3_op_scope - operation in progress
+ * @op: operation
+ * @start: start time
+ */
+struct ak3_op_scope {
+	int op;
+	ktime_t start;
+};
+
+static inline void ak3_op_stats_init(struct ak3_op_stats *ops, const char * const *names,
+				     struct ak3_op_stat *stats, int num_ops)
+{
+	ops->names = names;
+	ops->stats = stats;
+	ops->num_ops = num_ops;
+	spin_lock_init(&ops->lock);
+}
+
+static inline void ak3_op_begin(struct ak3_op_stats *ops, struct ak3_op_scope *scope, int op)
+{
+	DPU_ATRACE_BEGIN(ops->names[op]);
+	scope->op = op;
+	scope->start = ktime_get();
+}
+
+static inline void ak3_op_end(struct ak3_op_stats *ops, const struct ak3_op_scope *scope)
+{
+	struct ak3_op_stat *stat = &ops->stats[scope->op];
+	u32 us = ktime_us_delta(ktime_get(), scope->start);
+	int bucket = us ? min(ilog2(us) + 1, AK3_OP_HIST_BUCKETS - 1) : 0;
+	unsigned long irqflags;
+
+	spin_lock_irqsave(&ops->lock, irqflags);
+	stat->count++;
+	stat->total_us += us;
+	stat->max_us = max(stat->max_us, us);
+	stat->hist[bucket]++;
+	spin_unlock_irqrestore(&ops->lock, irqflags);
+	DPU_ATRACE_END(ops->names[scope->op]);
+}
+
+static inline void ak3_op_stats_show(struct seq_file *m, struct ak3_op_stats *ops)
+{
+	struct ak3_op_stat stat;
+	unsigned long irqflags;
+	int op, i;
+
+	seq_puts(m, "op count total_us max_us hist_log2_us[<1,<2,<4,...]\n");
+	for (op = 0; op < ops->num_ops; op++) {
+		spin_lock_irqsave(&ops->lock, irqflags);
+		stat = ops->stats[op];
+		spin_unlock_irqrestore(&ops->lock, irqflags);
+
+		seq_printf(m, "%s %llu %llu %u", ops->names[op],
+			   stat.count, stat.total_us, stat.max_us);
+		for (i = 0; i < AK3_OP_HIST_BUCKETS; i++)
+			seq_printf(m, " %u", stat.hist[i]);
+		seq_putc(m, '\n');
+	}
+}
+
+static inline void ak3_op_stats_reset(struct ak3_op_stats *ops)
+{
+	unsigned long irqflags;
+
+	spin_lock_irqsave(&ops->lock, irqflags);
+	memset(ops->stats, 0, ops->num_ops * sizeof(*ops->stats));
+	spin_unlock_irqrestore(&ops->lock, irqflags);
+}
+
+#endif /* _PANEL_GOOGLE_AK3_OP_STATS_H_ */
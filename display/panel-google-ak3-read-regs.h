@@ -0,0 +1,80 @@
+/* SPDX-License-Identifier: GPL-2.0-only */
+/*
+ * Batched register reads, shared by the ak3a and ak3b drivers.
+ *
+ * Copyright (c) 2023 Google LLC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#ifndef _PANEL_GOOGLE_AK3_READ_REGS_H_
+#define _PANEL_GOOGLE_AK3_READ_REGS_H_
+
+#include <linux/bits.h>
+
+#include "panel/panel-samsung-drv.h"
+
+/**
+ * struct ak3_reg_read - register read at a global para offset
+ * @offset: global para offset of the first byte
+ * @reg: register to read
+ * @len: number of bytes to read
+ */
+struct ak3_reg_read {
+	u16 offset;
+	u8 reg;
+	u8 len;
+};
+
+#define AK3_REG_READ_MAX 32
+
+/**
+ * ak3_read_regs() - read a list of registers within a single test key bracket
+ * @ctx: panel struct
+ * @reads: register reads
+ * @count: number of entries in @reads, up to AK3_REG_READ_MAX
+ * @buf: destination, the results of @reads are stored back to back
+ * @failed: optional, set to the mask of entries which could not be read
+ *
+ * The test key on is sent along with the first global para, and the test key off
+ * is sent once after the last read. A failed read doesn't stop the remaining ones.
+ *
+ * Return: 0 if all the registers were read, -EIO otherwise.
+ */
+static inline int ak3_read_regs(struct exynos_panel *ctx, const struct ak3_reg_read *reads,
+				int count, u8 *buf, u32 *failed)
+{
+	struct mipi_dsi_device *dsi = to_mipi_dsi_device(ctx->dev);
+	u32 mask = 0;
+	int i, ret;
+
+	if (WARN_ON(count > AK3_REG_READ_MAX))
+		return -EINVAL;
+
+	EXYNOS_DCS_BUF_ADD(ctx, 0xF0, 0x5A, 0x5A); /* test_key_on */
+	for (i = 0; i < count; i++) {
+		const struct ak3_reg_read *rd = &reads[i];
+
+		/* the read can't be queued, flush the global para with it */
+		EXYNOS_DCS_BUF_ADD_AND_FLUSH(ctx, 0xB0, rd->offset >> 8,
+					     rd->offset & 0xFF, rd->reg);
+
+		ret = mipi_dsi_dcs_read(dsi, rd->reg, buf, rd->len);
+		if (ret != rd->len) {
+			dev_err(ctx->dev, "failed to read reg 0x%02x+0x%x ret=%d\n",
+				rd->reg, rd->offset, ret);
+			mask |= BIT(i);
+		}
+		buf += rd->len;
+	}
+	EXYNOS_DCS_BUF_ADD_AND_FLUSH(ctx, 0xF0, 0xA5, 0xA5); /* test_key_off */
+
+	if (failed)
+		*failed = mask;
+
+	return mask ? -EIO : 0;
+}
+
+#endif /* _PANEL_GOOGLE_AK3_READ_REGS_H_ */
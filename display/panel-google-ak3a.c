@@ -10,11 +10,17 @@
  */
 
 #include <drm/drm_vblank.h>
+#include <linux/debugfs.h>
 #include <linux/module.h>
 #include <linux/of_platform.h>
+#include <linux/seq_file.h>
 #include <video/mipi_display.h>
 
+#include "include/trace/dpu_trace.h"
 #include "panel/panel-samsung-drv.h"
+#include "panel-google-ak3-brightness.h"
+#include "panel-google-ak3-op-stats.h"
+#include "panel-google-ak3-read-regs.h"
 
 static const unsigned char pps_setting[] = {
 	0x11, 0x00, 0x00, 0x89, 0x30, 0x80, 0x09, 0x60,
@@ -62,10 +68,13 @@ static const u32 lhbm_1270_1300_rgb_ratio[LHBM_RGB_RATIO_SIZE] = {
 
 static const struct exynos_dsi_cmd ak3a_off_cmds[] = {
 	EXYNOS_DSI_CMD_SEQ(MIPI_DCS_SET_DISPLAY_OFF),
-	EXYNOS_DSI_CMD_SEQ_DELAY(120, 0x10), /* sleep in */
+	EXYNOS_DSI_CMD_SEQ(0x10), /* sleep in, see AK3A_SLEEP_IN_MS */
 };
 static DEFINE_EXYNOS_CMD_SET(ak3a_off);
 
+/* time the panel needs after sleep in before the rails drop or it is reset */
+#define AK3A_SLEEP_IN_MS 120
+
 static const struct exynos_dsi_cmd ak3a_lp_cmds[] = {
 	EXYNOS_DSI_CMD_SEQ(MIPI_DCS_SET_DISPLAY_OFF),
 	EXYNOS_DSI_CMD_SEQ(0xF0, 0x5A, 0x5A), //test_key_on_f0),
@@ -153,6 +162,87 @@ static const struct exynos_dsi_cmd ak3a_mode_hs_90_cmds[] = {
 static DEFINE_EXYNOS_CMD_SET(ak3a_mode_hs_90);
 
 #define LHBM_GAMMA_CMD_SIZE 6
+
+/**
+ * enum ak3a_lhbm_cal_step - LHBM calibration steps run after panel init
+ * @LHBM_CAL_IDLE: no calibration pending
+ * @LHBM_CAL_GAMMA: read LHBM gamma from OTP
+ * @LHBM_CAL_APPLY: scale and send LHBM gamma
+ */
+enum ak3a_lhbm_cal_step {
+	LHBM_CAL_IDLE = 0,
+	LHBM_CAL_GAMMA,
+	LHBM_CAL_APPLY,
+};
+
+/**
+ * enum ak3a_op - panel operations with DSI statistics
+ * @AK3A_OP_SET_BRIGHTNESS: set_brightness
+ * @AK3A_OP_CHANGE_FREQUENCY: change_frequency
+ * @AK3A_OP_SET_OP_HZ: set_op_hz
+ * @AK3A_OP_UPDATE_TE2: update_te2
+ * @AK3A_OP_UPDATE_WRCTRLD: update_wrctrld
+ * @AK3A_OP_LHBM: set_local_hbm_mode
+ * @AK3A_OP_ENABLE: enable
+ * @AK3A_OP_NOLP: set_nolp_mode
+ * @AK3A_OP_MAX: number of operations, also used when none is in progress
+ */
+enum ak3a_op {
+	AK3A_OP_SET_BRIGHTNESS = 0,
+	AK3A_OP_CHANGE_FREQUENCY,
+	AK3A_OP_SET_OP_HZ,
+	AK3A_OP_UPDATE_TE2,
+	AK3A_OP_UPDATE_WRCTRLD,
+	AK3A_OP_LHBM,
+	AK3A_OP_ENABLE,
+	AK3A_OP_NOLP,
+	AK3A_OP_MAX
+};
+
+static const char * const ak3a_op_names[AK3A_OP_MAX] = {
+	[AK3A_OP_SET_BRIGHTNESS] = "ak3a_set_brightness",
+	[AK3A_OP_CHANGE_FREQUENCY] = "ak3a_change_frequency",
+	[AK3A_OP_SET_OP_HZ] = "ak3a_set_op_hz",
+	[AK3A_OP_UPDATE_TE2] = "ak3a_update_te2",
+	[AK3A_OP_UPDATE_WRCTRLD] = "ak3a_update_wrctrld",
+	[AK3A_OP_LHBM] = "ak3a_lhbm",
+	[AK3A_OP_ENABLE] = "ak3a_enable",
+	[AK3A_OP_NOLP] = "ak3a_set_nolp_mode",
+};
+
+/**
+ * enum ak3a_te2_block - TE2 control blocks of register 0xCB
+ * @AK3A_TE2_HS90: HS 90Hz control
+ * @AK3A_TE2_HS60: HS 60Hz control
+ * @AK3A_TE2_LP: HLPM control
+ * @AK3A_TE2_MAX: number of blocks
+ */
+enum ak3a_te2_block {
+	AK3A_TE2_HS90,
+	AK3A_TE2_HS60,
+	AK3A_TE2_LP,
+	AK3A_TE2_MAX,
+};
+
+/* global para offsets of the TE2 control blocks */
+static const u16 ak3a_te2_offset[AK3A_TE2_MAX] = {
+	[AK3A_TE2_HS90] = 0x73,
+	[AK3A_TE2_HS60] = 0xC9,
+	[AK3A_TE2_LP] = 0x1C8,
+};
+
+/**
+ * struct ak3a_te2_cache - encoded TE2 control block
+ * @timing: timing @setting was encoded from
+ * @setting: encoded setting
+ * @written: whether the panel holds @setting
+ */
+struct ak3a_te2_cache {
+	struct exynos_panel_te2_timing timing;
+	u8 setting[3];
+	bool written;
+};
+
 /**
  * struct ak3a_panel - panel specific runtime info
  *
@@ -169,10 +259,49 @@ struct ak3a_panel {
 		u8 ns_cmd[LHBM_GAMMA_CMD_SIZE];
 		u8 aod_cmd[LHBM_GAMMA_CMD_SIZE];
 	} local_hbm_gamma;
+
+	/** @lhbm_cal_step: next LHBM calibration step, protected by mode_lock */
+	enum ak3a_lhbm_cal_step lhbm_cal_step;
+	/** @lhbm_cal_work: runs the LHBM calibration without blocking panel init */
+	struct work_struct lhbm_cal_work;
+	/** @needs_display_on: if display_on command needs to send after flip done */
+	bool needs_display_on;
+	/** @display_on_commit: first commit after enable, held by @display_on_work */
+	struct drm_crtc_commit *display_on_commit;
+	/** @display_on_work: sends display_on once @display_on_commit is flipped */
+	struct work_struct display_on_work;
+	/** @sleep_in_deadline: time the panel completes the last sleep in */
+	ktime_t sleep_in_deadline;
+
+	/** @brt: brightness writes coalesced and ramped by the driver */
+	struct ak3_brightness brt;
+
+	/** @op_stat: statistics per operation, referenced by @op_stats */
+	struct ak3_op_stat op_stat[AK3A_OP_MAX];
+	/** @op_stats: operation statistics of this panel */
+	struct ak3_op_stats op_stats;
+
+	/** @te2_cache: TE2 control blocks, cleared on panel reset */
+	struct ak3a_te2_cache te2_cache[AK3A_TE2_MAX];
+	/** @te2_on: whether TE2 output is enabled since the panel reset */
+	bool te2_on;
 };
 
 #define to_spanel(ctx) container_of(ctx, struct ak3a_panel, base)
 
+static void ak3a_lhbm_cal_finish(struct exynos_panel *ctx);
+
+static void ak3a_op_begin(struct exynos_panel *ctx, struct ak3_op_scope *scope,
+			  enum ak3a_op op)
+{
+	ak3_op_begin(&to_spanel(ctx)->op_stats, scope, op);
+}
+
+static void ak3a_op_end(struct exynos_panel *ctx, const struct ak3_op_scope *scope)
+{
+	ak3_op_end(&to_spanel(ctx)->op_stats, scope);
+}
+
 static void ak3a_update_lhbm_gamma(struct exynos_panel *ctx)
 {
 	/* ratio provided by HW for update the LHBM gamma.
@@ -234,56 +363,44 @@ static void ak3a_update_lhbm_gamma(struct exynos_panel *ctx)
 		rgb_ratio[0], rgb_ratio[1], rgb_ratio[2]);
 }
 
-static void ak3a_lhbm_gamma_read(struct exynos_panel *ctx)
+static const struct ak3_reg_read lhbm_gamma_reads[] = {
+	{ 0x22, 0xD8, LHBM_GAMMA_CMD_SIZE - 1 }, /* HS */
+	{ 0x1D, 0xD8, LHBM_GAMMA_CMD_SIZE - 1 }, /* NS */
+	{ 0x18, 0xD8, LHBM_GAMMA_CMD_SIZE - 1 }, /* AOD */
+};
+
+static int ak3a_lhbm_gamma_read(struct exynos_panel *ctx)
 {
-	struct mipi_dsi_device *dsi = to_mipi_dsi_device(ctx->dev);
 	struct ak3a_panel *spanel = to_spanel(ctx);
-	int ret;
-	u8 *hs_cmd = spanel->local_hbm_gamma.hs_cmd;
-	u8 *ns_cmd = spanel->local_hbm_gamma.ns_cmd;
-	u8 *aod_cmd = spanel->local_hbm_gamma.aod_cmd;
+	static const char * const names[] = { "hs", "ns", "aod" };
+	u8 *cmds[] = {
+		spanel->local_hbm_gamma.hs_cmd,
+		spanel->local_hbm_gamma.ns_cmd,
+		spanel->local_hbm_gamma.aod_cmd,
+	};
+	u8 data[ARRAY_SIZE(lhbm_gamma_reads)][LHBM_GAMMA_CMD_SIZE - 1];
 	u8 buf[LHBM_GAMMA_CMD_SIZE * 2] = {0};
+	u32 failed;
+	int i, err;
 
-	EXYNOS_DCS_BUF_ADD_SET(ctx, test_key_on_f0);
+	err = ak3_read_regs(ctx, lhbm_gamma_reads, ARRAY_SIZE(lhbm_gamma_reads),
+			     &data[0][0], &failed);
 
-	EXYNOS_DCS_BUF_ADD_AND_FLUSH(ctx, 0xB0, 0x00, 0x22, 0xD8); /* global para */
-	ret = mipi_dsi_dcs_read(dsi, 0xD8, hs_cmd + 1, LHBM_GAMMA_CMD_SIZE - 1);
-	if (ret == (LHBM_GAMMA_CMD_SIZE - 1)) {
-		/* fill in gamma write command 0x66 in offset 0 */
-		hs_cmd[0] = 0x66;
-		exynos_bin2hex(hs_cmd + 1, LHBM_GAMMA_CMD_SIZE - 1,
-			buf, sizeof(buf));
-		dev_info(ctx->dev, "%s: hs_gamma: %s\n", __func__, buf);
-	} else {
-		dev_err(ctx->dev, "fail to read LHBM gamma for HS\n");
-	}
-	EXYNOS_DCS_WRITE_SEQ(ctx, 0xB0, 0x00, 0x1D, 0xD8); /* global para */
-	ret = mipi_dsi_dcs_read(dsi, 0xD8, ns_cmd + 1, LHBM_GAMMA_CMD_SIZE - 1);
-	if (ret == (LHBM_GAMMA_CMD_SIZE - 1)) {
-		/* fill in gamma write command 0x66 in offset 0 */
-		ns_cmd[0] = 0x66;
-		exynos_bin2hex(ns_cmd + 1, LHBM_GAMMA_CMD_SIZE - 1,
-			buf, sizeof(buf));
-		dev_info(ctx->dev, "%s: ns_gamma: %s\n", __func__, buf);
-	} else {
-		dev_err(ctx->dev, "fail to read LHBM gamma for NS\n");
-	}
+	for (i = 0; i < ARRAY_SIZE(lhbm_gamma_reads); i++) {
+		if (failed & BIT(i)) {
+			dev_err(ctx->dev, "fail to read LHBM gamma for %s\n", names[i]);
+			continue;
+		}
 
-	EXYNOS_DCS_WRITE_SEQ(ctx, 0xB0, 0x00, 0x18, 0xD8); /* global para */
-	ret = mipi_dsi_dcs_read(dsi, 0xD8, aod_cmd + 1, LHBM_GAMMA_CMD_SIZE - 1);
-	if (ret == (LHBM_GAMMA_CMD_SIZE - 1)) {
 		/* fill in gamma write command 0x66 in offset 0 */
-		aod_cmd[0] = 0x66;
-		exynos_bin2hex(aod_cmd + 1, LHBM_GAMMA_CMD_SIZE - 1,
+		cmds[i][0] = 0x66;
+		memcpy(cmds[i] + 1, data[i], LHBM_GAMMA_CMD_SIZE - 1);
+		exynos_bin2hex(cmds[i] + 1, LHBM_GAMMA_CMD_SIZE - 1,
 			buf, sizeof(buf));
-		dev_info(ctx->dev, "%s: aod_gamma: %s\n", __func__, buf);
-	} else {
-		dev_err(ctx->dev, "fail to read LHBM gamma for AOD\n");
+		dev_info(ctx->dev, "%s: %s_gamma: %s\n", __func__, names[i], buf);
 	}
 
-	EXYNOS_DCS_BUF_ADD_SET_AND_FLUSH(ctx, test_key_off_f0);
-
-	ak3a_update_lhbm_gamma(ctx);
+	return err;
 }
 
 static void ak3a_lhbm_gamma_write(struct exynos_panel *ctx)
@@ -340,56 +457,90 @@ static void ak3a_get_te2_setting(struct exynos_panel_te2_timing *timing,
 	setting[2] = width_low_byte;
 }
 
+/*
+ * Encode @timing into the cached block. Returns true if the block needs to be
+ * written, that is if the timing changed or the panel doesn't hold it yet.
+ */
+static bool ak3a_te2_cache_update(struct ak3a_panel *spanel, enum ak3a_te2_block block,
+				  const struct exynos_panel_te2_timing *timing)
+{
+	struct ak3a_te2_cache *cache = &spanel->te2_cache[block];
+
+	if (cache->written && cache->timing.rising_edge == timing->rising_edge &&
+	    cache->timing.falling_edge == timing->falling_edge)
+		return false;
+
+	cache->timing = *timing;
+	ak3a_get_te2_setting(&cache->timing, cache->setting);
+	cache->written = false;
+
+	return true;
+}
+
 static void ak3a_update_te2(struct exynos_panel *ctx)
 {
+	struct ak3a_panel *spanel;
+	struct ak3_op_scope scope;
 	struct exynos_panel_te2_timing timing;
-	u8 hs_90hz_setting[4] = {0xCB, 0x00, 0x0C, 0x32};
-	u8 hs_60hz_setting[4] = {0xCB, 0x00, 0x0C, 0x32};
-
-	u8 lp_setting[4] = {0xCB, 0x00, 0x0C, 0x23}; // lp low/high
+	unsigned long dirty = 0;
+	int block;
 
 	if (!ctx)
 		return;
 
-	/* HS mode */
-	timing = ctx->te2.mode_data[0].timing;
-	ak3a_get_te2_setting(&timing, &hs_90hz_setting[1]);
-
-	dev_dbg(ctx->dev, "TE2 updated HS 90Hz: [HEX] %*ph\n", 4, hs_90hz_setting);
+	spanel = to_spanel(ctx);
 
-	timing = ctx->te2.mode_data[1].timing;
-	ak3a_get_te2_setting(&timing, &hs_60hz_setting[1]);
-
-	dev_dbg(ctx->dev, "TE2 updated HS 60Hz: [HEX] %*ph\n", 4, hs_60hz_setting);
+	/* HS mode */
+	if (ak3a_te2_cache_update(spanel, AK3A_TE2_HS90, &ctx->te2.mode_data[0].timing))
+		dirty |= BIT(AK3A_TE2_HS90);
+	if (ak3a_te2_cache_update(spanel, AK3A_TE2_HS60, &ctx->te2.mode_data[1].timing))
+		dirty |= BIT(AK3A_TE2_HS60);
 
 	/* LP mode */
 	if (ctx->current_mode->exynos_mode.is_lp_mode) {
 		int ret = exynos_panel_get_current_mode_te2(ctx, &timing);
 
-		if (!ret)
-			ak3a_get_te2_setting(&timing, &lp_setting[1]);
-		else if (ret == -EAGAIN)
+		if (ret == -EAGAIN) {
 			dev_dbg(ctx->dev,
 				"Panel is not ready, use default setting\n");
-		else
+			/* lp low/high */
+			timing.rising_edge = 12;
+			timing.falling_edge = 12 + 35;
+		} else if (ret) {
 			return;
+		}
 
-		dev_dbg(ctx->dev, "TE2 updated LP: [HEX] %*ph\n", 4, lp_setting);
+		if (ak3a_te2_cache_update(spanel, AK3A_TE2_LP, &timing))
+			dirty |= BIT(AK3A_TE2_LP);
 	}
 
+	/* the panel already holds all the settings */
+	if (!dirty && spanel->te2_on)
+		return;
+
+	ak3a_op_begin(ctx, &scope, AK3A_OP_UPDATE_TE2);
 	EXYNOS_DCS_BUF_ADD_SET(ctx, test_key_on_f0);
-	EXYNOS_DCS_BUF_ADD(ctx, 0xB0, 0x00, 0x2B, 0xF2); /* global para */
-	EXYNOS_DCS_BUF_ADD(ctx, 0xF2, 0x03, 0x14); /* TE2 on */
-	EXYNOS_DCS_BUF_ADD(ctx, 0xB0, 0x00, 0x73, 0xCB); /* global para */
-	EXYNOS_DCS_BUF_ADD_SET(ctx, hs_90hz_setting); /* HS 90Hz control */
-	EXYNOS_DCS_BUF_ADD(ctx, 0xB0, 0x00, 0xC9, 0xCB); /* global para */
-	EXYNOS_DCS_BUF_ADD_SET(ctx, hs_60hz_setting); /* HS 60Hz control */
-	if (ctx->current_mode->exynos_mode.is_lp_mode) {
-		EXYNOS_DCS_BUF_ADD(ctx, 0xB0, 0x01, 0xC8, 0xCB); /* global para */
-		EXYNOS_DCS_BUF_ADD_SET(ctx, lp_setting); /* HLPM mode */
+	if (!spanel->te2_on) {
+		EXYNOS_DCS_BUF_ADD(ctx, 0xB0, 0x00, 0x2B, 0xF2); /* global para */
+		EXYNOS_DCS_BUF_ADD(ctx, 0xF2, 0x03, 0x14); /* TE2 on */
+	}
+	for (block = 0; block < AK3A_TE2_MAX; block++) {
+		struct ak3a_te2_cache *cache = &spanel->te2_cache[block];
+		const u16 offset = ak3a_te2_offset[block];
+
+		if (!(dirty & BIT(block)))
+			continue;
+
+		EXYNOS_DCS_BUF_ADD(ctx, 0xB0, offset >> 8, offset & 0xFF, 0xCB); /* global para */
+		EXYNOS_DCS_BUF_ADD(ctx, 0xCB, cache->setting[0], cache->setting[1],
+				   cache->setting[2]);
+		cache->written = true;
+		dev_dbg(ctx->dev, "TE2 updated block %d: [HEX] %*ph\n", block, 3, cache->setting);
 	}
 	EXYNOS_DCS_BUF_ADD_SET(ctx, freq_update); /* LTPS update */
 	EXYNOS_DCS_BUF_ADD_SET_AND_FLUSH(ctx, test_key_off_f0);
+	spanel->te2_on = true;
+	ak3a_op_end(ctx, &scope);
 }
 
 static void ak3a_change_frequency(struct exynos_panel *ctx,
@@ -397,10 +548,12 @@ static void ak3a_change_frequency(struct exynos_panel *ctx,
 {
 	const u8 hs60_setting[3] = {0x60, 0x08, 0x00}; // High Speed 60Hz
 	const u8 hs90_setting[3] = {0x60, 0x00, 0x00}; // High Speed 90Hz
+	struct ak3_op_scope scope;
 
 	if (!ctx || (vrefresh != 60 && vrefresh != 90))
 		return;
 
+	ak3a_op_begin(ctx, &scope, AK3A_OP_CHANGE_FREQUENCY);
 	EXYNOS_DCS_BUF_ADD_SET(ctx, test_key_on_f0);
 	if (vrefresh == 90) {
 		EXYNOS_DCS_BUF_ADD_SET(ctx, hs90_setting);
@@ -416,6 +569,7 @@ static void ak3a_change_frequency(struct exynos_panel *ctx,
 	}
 	EXYNOS_DCS_BUF_ADD_SET(ctx, freq_update);
 	EXYNOS_DCS_BUF_ADD_SET_AND_FLUSH(ctx, test_key_off_f0);
+	ak3a_op_end(ctx, &scope);
 
 	dev_dbg(ctx->dev, "%s: change to %uhz\n", __func__, vrefresh);
 }
@@ -423,6 +577,8 @@ static void ak3a_change_frequency(struct exynos_panel *ctx,
 static int ak3a_set_op_hz(struct exynos_panel *ctx, unsigned int hz)
 {
 	const unsigned int vrefresh = drm_mode_vrefresh(&ctx->current_mode->mode);
+	const struct exynos_dsi_cmd_set *cmd_set;
+	struct ak3_op_scope scope;
 
 	if ((vrefresh > hz) || ((hz != 60) && (hz != 90))) {
 		dev_err(ctx->dev, "invalid op_hz=%u for vrefresh=%u\n",
@@ -431,18 +587,17 @@ static int ak3a_set_op_hz(struct exynos_panel *ctx, unsigned int hz)
 	}
 
 	ctx->op_hz = hz;
-	if (ctx->op_hz == 60) {
-		exynos_panel_send_cmd_set(ctx,
-			&ak3a_mode_ns_60_cmd_set);
-	} else {
-		if (vrefresh == 60) {
-			exynos_panel_send_cmd_set(ctx,
-				&ak3a_mode_hs_60_cmd_set);
-		} else {
-			exynos_panel_send_cmd_set(ctx,
-				&ak3a_mode_hs_90_cmd_set);
-		}
-	}
+	if (ctx->op_hz == 60)
+		cmd_set = &ak3a_mode_ns_60_cmd_set;
+	else if (vrefresh == 60)
+		cmd_set = &ak3a_mode_hs_60_cmd_set;
+	else
+		cmd_set = &ak3a_mode_hs_90_cmd_set;
+
+	ak3a_op_begin(ctx, &scope, AK3A_OP_SET_OP_HZ);
+	exynos_panel_send_cmd_set(ctx, cmd_set);
+	ak3a_op_end(ctx, &scope);
+
 	dev_info(ctx->dev, "set op_hz at %u\n", hz);
 	return 0;
 }
@@ -450,6 +605,7 @@ static int ak3a_set_op_hz(struct exynos_panel *ctx, unsigned int hz)
 static void ak3a_update_wrctrld(struct exynos_panel *ctx)
 {
 	u8 val = AK3A_WRCTRLD_BCTRL_BIT;
+	struct ak3_op_scope scope;
 
 	if (IS_HBM_ON(ctx->hbm_mode))
 		val |= AK3A_WRCTRLD_HBM_BIT;
@@ -457,7 +613,7 @@ static void ak3a_update_wrctrld(struct exynos_panel *ctx)
 	if (ctx->hbm.local_hbm.enabled)
 		val |= AK3A_WRCTRLD_LOCAL_HBM_BIT;
 
-	if (ctx->dimming_on)
+	if (ctx->dimming_on || to_spanel(ctx)->brt.ramp.hw_dimming)
 		val |= AK3A_WRCTRLD_DIMMING_BIT;
 
 	dev_dbg(ctx->dev,
@@ -466,13 +622,33 @@ static void ak3a_update_wrctrld(struct exynos_panel *ctx)
 		ctx->dimming_on ? "on" : "off",
 		ctx->hbm.local_hbm.enabled ? "on" : "off");
 
+	ak3a_op_begin(ctx, &scope, AK3A_OP_UPDATE_WRCTRLD);
 	EXYNOS_DCS_WRITE_SEQ(ctx, MIPI_DCS_WRITE_CONTROL_DISPLAY, val);
+	ak3a_op_end(ctx, &scope);
+}
+
+static int ak3a_write_brightness(struct exynos_panel *ctx, u16 br)
+{
+	struct ak3_op_scope scope;
+	u16 brightness = (br & 0xff) << 8 | br >> 8;
+	int ret;
+
+	ak3a_op_begin(ctx, &scope, AK3A_OP_SET_BRIGHTNESS);
+	ret = exynos_dcs_set_brightness(ctx, brightness);
+	ak3a_op_end(ctx, &scope);
+
+	return ret;
 }
 
+static const struct ak3_brightness_funcs ak3a_brightness_funcs = {
+	.write = ak3a_write_brightness,
+	.update_wrctrld = ak3a_update_wrctrld,
+};
+
 #define MAX_BR_HBM_EVT1_0_2 4094
 static int ak3a_set_brightness(struct exynos_panel *ctx, u16 br)
 {
-	u16 brightness;
+	struct ak3a_panel *spanel = to_spanel(ctx);
 
 	if (ctx->current_mode->exynos_mode.is_lp_mode) {
 		const struct exynos_panel_funcs *funcs;
@@ -489,38 +665,155 @@ static int ak3a_set_brightness(struct exynos_panel *ctx, u16 br)
 			__func__, MAX_BR_HBM_EVT1_0_2);
 	}
 
-	brightness = (br & 0xff) << 8 | br >> 8;
-
-	return exynos_dcs_set_brightness(ctx, brightness);
+	return ak3_brightness_set(&spanel->brt, br);
 }
 
 static void ak3a_set_nolp_mode(struct exynos_panel *ctx,
 				  const struct exynos_panel_mode *pmode)
 {
+	const struct exynos_panel_mode *current_mode = ctx->current_mode;
+	unsigned int aod_vrefresh = current_mode ? drm_mode_vrefresh(&current_mode->mode) : 30;
 	unsigned int vrefresh = drm_mode_vrefresh(&pmode->mode);
-	u32 delay_us = mult_frac(1000, 1020, vrefresh);
+	unsigned int aod_te_usec = current_mode ? current_mode->exynos_mode.te_usec : 0;
+	struct ak3_op_scope scope;
 
 	if (!ctx->enabled)
 		return;
 
-	EXYNOS_DCS_BUF_ADD(ctx, MIPI_DCS_SET_DISPLAY_OFF);
+	ak3a_op_begin(ctx, &scope, AK3A_OP_NOLP);
+
 	EXYNOS_DCS_BUF_ADD_SET(ctx, test_key_on_f0);
 	EXYNOS_DCS_BUF_ADD_SET_AND_FLUSH(ctx, new_gamma_ip_enable);
 	/* backlight control and dimming */
 	ak3a_update_wrctrld(ctx);
 	EXYNOS_DCS_BUF_ADD_SET_AND_FLUSH(ctx, test_key_off_f0);
 	ak3a_change_frequency(ctx, vrefresh);
-	usleep_range(delay_us, delay_us + 10);
-	EXYNOS_DCS_BUF_ADD_AND_FLUSH(ctx, MIPI_DCS_SET_DISPLAY_ON);
 
+	DPU_ATRACE_BEGIN("ak3a_wait_one_vblank");
+	exynos_panel_wait_for_vsync_done(ctx, aod_te_usec,
+			EXYNOS_VREFRESH_TO_PERIOD_USEC(aod_vrefresh));
+
+	/* Additional sleep time to account for TE variability */
+	usleep_range(1000, 1010);
+	DPU_ATRACE_END("ak3a_wait_one_vblank");
+
+	ak3a_op_end(ctx, &scope);
 	dev_info(ctx->dev, "exit LP mode\n");
 }
 
+/* wait for whatever remains of the sleep in sent by the last disable */
+static void ak3a_wait_sleep_in(struct exynos_panel *ctx)
+{
+	const s64 remaining_us = ktime_us_delta(to_spanel(ctx)->sleep_in_deadline, ktime_get());
+
+	if (remaining_us <= 0)
+		return;
+
+	DPU_ATRACE_BEGIN("ak3a_wait_sleep_in");
+	usleep_range(remaining_us, remaining_us + 100);
+	DPU_ATRACE_END("ak3a_wait_sleep_in");
+}
+
+static int ak3a_atomic_check(struct exynos_panel *ctx, struct drm_atomic_state *state)
+{
+	struct drm_connector *conn = &ctx->exynos_connector.base;
+	struct drm_connector_state *new_conn_state =
+					drm_atomic_get_new_connector_state(state, conn);
+	struct drm_crtc_state *old_crtc_state, *new_crtc_state;
+
+	if (!ctx->current_mode || drm_mode_vrefresh(&ctx->current_mode->mode) == 90 ||
+	    !new_conn_state || !new_conn_state->crtc)
+		return 0;
+
+	new_crtc_state = drm_atomic_get_new_crtc_state(state, new_conn_state->crtc);
+	old_crtc_state = drm_atomic_get_old_crtc_state(state, new_conn_state->crtc);
+	if (!old_crtc_state || !new_crtc_state || !new_crtc_state->active)
+		return 0;
+
+	if (!drm_atomic_crtc_effectively_active(old_crtc_state)) {
+		struct drm_display_mode *mode = &new_crtc_state->adjusted_mode;
+
+		mode->clock = mode->htotal * mode->vtotal * 90 / 1000;
+		if (mode->clock != new_crtc_state->mode.clock) {
+			new_crtc_state->mode_changed = true;
+			ctx->exynos_connector.needs_commit = true;
+			dev_dbg(ctx->dev, "raise mode (%s) clock to 90hz on resume\n",
+				mode->name);
+		}
+	} else if (old_crtc_state->adjusted_mode.clock != old_crtc_state->mode.clock) {
+		/* clock hacked in last commit due to resume, undo that */
+		new_crtc_state->mode_changed = true;
+		new_crtc_state->adjusted_mode.clock = new_crtc_state->mode.clock;
+		ctx->exynos_connector.needs_commit = false;
+		dev_dbg(ctx->dev, "restore mode (%s) clock after resume\n",
+			new_crtc_state->mode.name);
+	}
+
+	return 0;
+}
+
+static void ak3a_commit_done(struct exynos_panel *ctx)
+{
+	struct ak3a_panel *spanel = to_spanel(ctx);
+	struct drm_crtc_commit *commit;
+
+	if (!ctx->crtc || !ctx->crtc->state || !ctx->crtc->state->commit) {
+		dev_dbg(ctx->dev, "invalid crtc or commit\n");
+		return;
+	}
+
+	if (!is_panel_active(ctx))
+		return;
+
+	/* later commits don't need to wait, the first flip turns the display on */
+	if (!spanel->needs_display_on || spanel->display_on_commit)
+		return;
+
+	commit = ctx->crtc->state->commit;
+	spanel->display_on_commit = drm_crtc_commit_get(commit);
+	schedule_work(&spanel->display_on_work);
+}
+
+static void ak3a_display_on_work(struct work_struct *work)
+{
+	struct ak3a_panel *spanel = container_of(work, struct ak3a_panel, display_on_work);
+	struct exynos_panel *ctx = &spanel->base;
+	struct drm_crtc_commit *commit = spanel->display_on_commit;
+
+	DPU_ATRACE_BEGIN("ak3a_wait_for_flip_done");
+	if (!wait_for_completion_timeout(&commit->flip_done, msecs_to_jiffies(100)))
+		dev_warn(ctx->dev, "timeout when waiting for flip done\n");
+	DPU_ATRACE_END("ak3a_wait_for_flip_done");
+
+	mutex_lock(&ctx->mode_lock);
+	/* the panel may have been disabled while waiting */
+	if (is_panel_active(ctx) && spanel->needs_display_on) {
+		EXYNOS_DCS_BUF_ADD_AND_FLUSH(ctx, MIPI_DCS_SET_DISPLAY_ON);
+		spanel->needs_display_on = false;
+		dev_info(ctx->dev, "%s: DISPLAY_ON\n", __func__);
+	}
+	spanel->display_on_commit = NULL;
+	mutex_unlock(&ctx->mode_lock);
+
+	drm_crtc_commit_put(commit);
+}
+
+static void ak3a_cancel_display_on(struct ak3a_panel *spanel)
+{
+	/* release the commit if the work didn't get to run */
+	if (cancel_work_sync(&spanel->display_on_work)) {
+		drm_crtc_commit_put(spanel->display_on_commit);
+		spanel->display_on_commit = NULL;
+	}
+}
+
 static int ak3a_enable(struct drm_panel *panel)
 {
 	struct exynos_panel *ctx = container_of(panel, struct exynos_panel, panel);
 	const struct exynos_panel_mode *pmode = ctx->current_mode;
 	const struct drm_display_mode *mode;
+	struct ak3a_panel *spanel = to_spanel(ctx);
+	struct ak3_op_scope scope;
 
 	if (!pmode) {
 		dev_err(ctx->dev, "no current mode set\n");
@@ -528,15 +821,25 @@ static int ak3a_enable(struct drm_panel *panel)
 	}
 	mode = &pmode->mode;
 
+	ak3a_op_begin(ctx, &scope, AK3A_OP_ENABLE);
+
 	dev_dbg(ctx->dev, "%s\n", __func__);
 
+	ak3a_wait_sleep_in(ctx);
 	exynos_panel_reset(ctx);
+	/* TE2 registers are back to their defaults after reset */
+	memset(spanel->te2_cache, 0, sizeof(spanel->te2_cache));
+	spanel->te2_on = false;
 
 	exynos_panel_send_cmd_set(ctx, &ak3a_init_cmd_set);
 
 	ak3a_change_frequency(ctx, drm_mode_vrefresh(mode));
 
-	ak3a_lhbm_gamma_write(ctx);
+	/* pending calibration sends LHBM gamma when it completes */
+	if (spanel->lhbm_cal_step == LHBM_CAL_IDLE)
+		ak3a_lhbm_gamma_write(ctx);
+	else
+		schedule_work(&spanel->lhbm_cal_work);
 	exynos_panel_send_cmd_set(ctx, &ak3a_lhbm_location_cmd_set);
 
 	/* DSC related configuration */
@@ -552,11 +855,38 @@ static int ak3a_enable(struct drm_panel *panel)
 	if (pmode->exynos_mode.is_lp_mode)
 		exynos_panel_set_lp_mode(ctx, pmode);
 	else
-		EXYNOS_DCS_WRITE_SEQ(ctx, MIPI_DCS_SET_DISPLAY_ON); /* display on */
+		spanel->needs_display_on = true;
+
+	ak3a_op_end(ctx, &scope);
 
 	return 0;
 }
 
+static int ak3a_disable(struct drm_panel *panel)
+{
+	struct exynos_panel *exynos_panel = container_of(panel, struct exynos_panel, panel);
+	struct ak3a_panel *spanel = to_spanel(exynos_panel);
+	int ret;
+
+	spanel->needs_display_on = false;
+	ak3a_cancel_display_on(spanel);
+	ak3_brightness_cancel(&spanel->brt);
+	ret = exynos_panel_disable(panel);
+	/* don't hold the caller for the sleep in, unprepare or enable wait for it */
+	spanel->sleep_in_deadline = ktime_add_ms(ktime_get(), AK3A_SLEEP_IN_MS);
+
+	return ret;
+}
+
+static int ak3a_unprepare(struct drm_panel *panel)
+{
+	struct exynos_panel *ctx = container_of(panel, struct exynos_panel, panel);
+
+	ak3a_wait_sleep_in(ctx);
+
+	return exynos_panel_unprepare(panel);
+}
+
 static void ak3a_set_hbm_mode(struct exynos_panel *exynos_panel,
 				enum exynos_hbm_mode mode)
 {
@@ -565,6 +895,9 @@ static void ak3a_set_hbm_mode(struct exynos_panel *exynos_panel,
 	const bool irc_update =
 		(IS_HBM_ON_IRC_OFF(exynos_panel->hbm_mode) != IS_HBM_ON_IRC_OFF(mode));
 
+	/* the brightness requested before the HBM change goes out first */
+	ak3_brightness_flush(&to_spanel(exynos_panel)->brt);
+
 	exynos_panel->hbm_mode = mode;
 
 	if (hbm_update)
@@ -598,7 +931,15 @@ static void ak3a_set_dimming_on(struct exynos_panel *exynos_panel,
 static void ak3a_set_local_hbm_mode(struct exynos_panel *exynos_panel,
 				 bool local_hbm_en)
 {
+	struct ak3_op_scope scope;
+
+	/* the request came before the deferred calibration completed */
+	if (local_hbm_en && to_spanel(exynos_panel)->lhbm_cal_step != LHBM_CAL_IDLE)
+		ak3a_lhbm_cal_finish(exynos_panel);
+
+	ak3a_op_begin(exynos_panel, &scope, AK3A_OP_LHBM);
 	ak3a_update_wrctrld(exynos_panel);
+	ak3a_op_end(exynos_panel, &scope);
 }
 
 static void ak3a_mode_set(struct exynos_panel *ctx,
@@ -614,16 +955,190 @@ static bool ak3a_is_mode_seamless(const struct exynos_panel *ctx,
 	return drm_mode_equal_no_clocks(&ctx->current_mode->mode, &pmode->mode);
 }
 
+/* run one LHBM calibration step, the caller must hold mode_lock */
+static void ak3a_lhbm_cal_run_step(struct exynos_panel *ctx)
+{
+	struct ak3a_panel *spanel = to_spanel(ctx);
+
+	dev_dbg(ctx->dev, "%s: step %d\n", __func__, spanel->lhbm_cal_step);
+
+	switch (spanel->lhbm_cal_step) {
+	case LHBM_CAL_GAMMA:
+		ak3a_lhbm_gamma_read(ctx);
+		spanel->lhbm_cal_step = LHBM_CAL_APPLY;
+		break;
+	case LHBM_CAL_APPLY:
+		ak3a_update_lhbm_gamma(ctx);
+		ak3a_lhbm_gamma_write(ctx);
+		spanel->lhbm_cal_step = LHBM_CAL_IDLE;
+		dev_info(ctx->dev, "lhbm calibration done\n");
+		break;
+	default:
+		break;
+	}
+}
+
+/* complete the pending LHBM calibration synchronously, with mode_lock held */
+static void ak3a_lhbm_cal_finish(struct exynos_panel *ctx)
+{
+	struct ak3a_panel *spanel = to_spanel(ctx);
+
+	while (spanel->lhbm_cal_step != LHBM_CAL_IDLE)
+		ak3a_lhbm_cal_run_step(ctx);
+}
+
+/*
+ * The calibration is split in steps, and mode_lock is dropped in between so that
+ * commits and other panel operations are not held off by the OTP reads. It pauses
+ * while the panel is off and is resumed by the next enable.
+ */
+static void ak3a_lhbm_cal_work(struct work_struct *work)
+{
+	struct ak3a_panel *spanel = container_of(work, struct ak3a_panel, lhbm_cal_work);
+	struct exynos_panel *ctx = &spanel->base;
+	bool done;
+
+	do {
+		mutex_lock(&ctx->mode_lock);
+		if (is_panel_active(ctx) && spanel->lhbm_cal_step != LHBM_CAL_IDLE)
+			ak3a_lhbm_cal_run_step(ctx);
+		done = !is_panel_active(ctx) || spanel->lhbm_cal_step == LHBM_CAL_IDLE;
+		mutex_unlock(&ctx->mode_lock);
+	} while (!done);
+}
+
+static int ak3a_op_stats_show(struct seq_file *m, void *data)
+{
+	struct exynos_panel *ctx = m->private;
+
+	ak3_op_stats_show(m, &to_spanel(ctx)->op_stats);
+
+	return 0;
+}
+static int ak3a_op_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ak3a_op_stats_show, inode->i_private);
+}
+
+/* any write resets the statistics */
+static ssize_t ak3a_op_stats_write(struct file *file, const char __user *user_buf,
+				   size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct exynos_panel *ctx = m->private;
+
+	ak3_op_stats_reset(&to_spanel(ctx)->op_stats);
+
+	return count;
+}
+
+static const struct file_operations ak3a_op_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = ak3a_op_stats_open,
+	.read = seq_read,
+	.write = ak3a_op_stats_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 static void ak3a_panel_init(struct exynos_panel *ctx)
 {
 	struct dentry *csroot = ctx->debugfs_cmdset_entry;
+	struct ak3a_panel *spanel = to_spanel(ctx);
 
 	exynos_panel_debugfs_create_cmdset(ctx, csroot,
 					   &ak3a_init_cmd_set, "init");
-	ak3a_lhbm_gamma_read(ctx);
-	ak3a_lhbm_gamma_write(ctx);
+	debugfs_create_file("op_stats", 0600, ctx->debugfs_entry, ctx, &ak3a_op_stats_fops);
+
+	/* deferred so that LHBM calibration doesn't hold off the first frame */
+	spanel->lhbm_cal_step = LHBM_CAL_GAMMA;
+	schedule_work(&spanel->lhbm_cal_work);
+}
+
+static ssize_t brightness_coalesce_show(struct device *dev,
+					struct device_attribute *attr, char *buf)
+{
+	struct mipi_dsi_device *dsi = to_mipi_dsi_device(dev);
+	struct exynos_panel *ctx = mipi_dsi_get_drvdata(dsi);
+
+	return sysfs_emit(buf, "%d\n", to_spanel(ctx)->brt.coalesce);
+}
+
+static ssize_t brightness_coalesce_store(struct device *dev, struct device_attribute *attr,
+					 const char *buf, size_t count)
+{
+	struct mipi_dsi_device *dsi = to_mipi_dsi_device(dev);
+	struct exynos_panel *ctx = mipi_dsi_get_drvdata(dsi);
+	struct ak3a_panel *spanel = to_spanel(ctx);
+	bool enable;
+	int ret;
+
+	ret = kstrtobool(buf, &enable);
+	if (ret)
+		return ret;
+
+	mutex_lock(&ctx->mode_lock);
+	spanel->brt.coalesce = enable;
+	if (!enable && is_panel_active(ctx))
+		ak3_brightness_flush(&spanel->brt);
+	mutex_unlock(&ctx->mode_lock);
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(brightness_coalesce);
+
+static ssize_t brightness_ramp_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct mipi_dsi_device *dsi = to_mipi_dsi_device(dev);
+	struct exynos_panel *ctx = mipi_dsi_get_drvdata(dsi);
+	const struct ak3_brightness_ramp *ramp = &to_spanel(ctx)->brt.ramp;
+	ssize_t ret;
+
+	mutex_lock(&ctx->mode_lock);
+	if (ramp->active)
+		ret = sysfs_emit(buf, "%u -> %u step %u/%u every %ums%s\n", ramp->start,
+				 ramp->target, ramp->step, ramp->num_steps, ramp->interval_ms,
+				 ramp->hw_dimming ? " hw dimming" : "");
+	else
+		ret = sysfs_emit(buf, "idle\n");
+	mutex_unlock(&ctx->mode_lock);
+
+	return ret;
+}
+
+/* "<target dbv> <duration ms>" starts a ramp */
+static ssize_t brightness_ramp_store(struct device *dev, struct device_attribute *attr,
+				     const char *buf, size_t count)
+{
+	struct mipi_dsi_device *dsi = to_mipi_dsi_device(dev);
+	struct exynos_panel *ctx = mipi_dsi_get_drvdata(dsi);
+	u32 target, duration_ms;
+	int ret;
+
+	if (sscanf(buf, "%u %u", &target, &duration_ms) != 2)
+		return -EINVAL;
+
+	mutex_lock(&ctx->mode_lock);
+	ret = ak3_ramp_start(&to_spanel(ctx)->brt, target, duration_ms);
+	mutex_unlock(&ctx->mode_lock);
+
+	return ret ? : count;
 }
 
+static DEVICE_ATTR_RW(brightness_ramp);
+
+static struct attribute *ak3a_attrs[] = {
+	&dev_attr_brightness_coalesce.attr,
+	&dev_attr_brightness_ramp.attr,
+	NULL
+};
+
+static const struct attribute_group ak3a_attr_group = {
+	.attrs = ak3a_attrs,
+};
+
 static void ak3a_get_panel_rev(struct exynos_panel *ctx, u32 id)
 {
 	/* extract command 0xDB */
@@ -672,17 +1187,49 @@ static void ak3a_get_panel_rev(struct exynos_panel *ctx, u32 id)
 	dev_info(ctx->dev, "panel_rev: 0x%x, build id: 0x%x\n", ctx->panel_rev, rev);
 }
 
+static void ak3a_cancel_work(void *data)
+{
+	struct ak3a_panel *spanel = data;
+
+	cancel_work_sync(&spanel->lhbm_cal_work);
+	ak3_brightness_cancel(&spanel->brt);
+	ak3a_cancel_display_on(spanel);
+}
+
 static int ak3a_panel_probe(struct mipi_dsi_device *dsi)
 {
 	struct ak3a_panel *spanel;
+	int ret;
 
 	spanel = devm_kzalloc(&dsi->dev, sizeof(*spanel), GFP_KERNEL);
 	if (!spanel)
 		return -ENOMEM;
 
 	spanel->base.op_hz = 90;
+	ak3_op_stats_init(&spanel->op_stats, ak3a_op_names, spanel->op_stat, AK3A_OP_MAX);
+
+	INIT_WORK(&spanel->lhbm_cal_work, ak3a_lhbm_cal_work);
+	ak3_brightness_init(&spanel->brt, &spanel->base, &ak3a_brightness_funcs);
+	INIT_WORK(&spanel->display_on_work, ak3a_display_on_work);
+	ret = devm_add_action_or_reset(&dsi->dev, ak3a_cancel_work, spanel);
+	if (ret)
+		return ret;
+
+	ret = exynos_panel_common_init(dsi, &spanel->base);
+	if (ret)
+		return ret;
+
+	return devm_device_add_group(&dsi->dev, &ak3a_attr_group);
+}
+
+static void ak3a_panel_remove(struct mipi_dsi_device *dsi)
+{
+	struct exynos_panel *ctx = mipi_dsi_get_drvdata(dsi);
+
+	/* the devm actions only run after the common teardown */
+	ak3a_cancel_work(to_spanel(ctx));
 
-	return exynos_panel_common_init(dsi, &spanel->base);
+	exynos_panel_remove(dsi);
 }
 
 static const struct exynos_display_underrun_param underrun_param = {
@@ -798,8 +1345,8 @@ static const struct exynos_panel_mode ak3a_lp_mode = {
 };
 
 static const struct drm_panel_funcs ak3a_drm_funcs = {
-	.disable = exynos_panel_disable,
-	.unprepare = exynos_panel_unprepare,
+	.disable = ak3a_disable,
+	.unprepare = ak3a_unprepare,
 	.prepare = exynos_panel_prepare,
 	.enable = ak3a_enable,
 	.get_modes = exynos_panel_get_modes,
@@ -822,6 +1369,8 @@ static const struct exynos_panel_funcs ak3a_exynos_funcs = {
 	.update_te2 = ak3a_update_te2,
 	.set_op_hz = ak3a_set_op_hz,
 	.read_id = exynos_panel_read_ddic_id,
+	.atomic_check = ak3a_atomic_check,
+	.commit_done = ak3a_commit_done,
 };
 
 const struct brightness_capability ak3a_brightness_capability = {
@@ -890,7 +1439,7 @@ MODULE_DEVICE_TABLE(of, exynos_panel_of_match);
 
 static struct mipi_dsi_driver exynos_panel_driver = {
 	.probe = ak3a_panel_probe,
-	.remove = exynos_panel_remove,
+	.remove = ak3a_panel_remove,
 	.driver = {
 		.name = "panel-google-ak3a",
 		.of_match_table = exynos_panel_of_match,
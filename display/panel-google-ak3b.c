@@ -9,12 +9,18 @@
  * published by the Free Software Foundation.
  */
 
+#include <linux/debugfs.h>
+#include <linux/input.h>
 #include <linux/module.h>
 #include <linux/of_platform.h>
+#include <linux/seq_file.h>
 #include <video/mipi_display.h>
 
 #include "include/trace/dpu_trace.h"
 #include "panel/panel-samsung-drv.h"
+#include "panel-google-ak3-brightness.h"
+#include "panel-google-ak3-op-stats.h"
+#include "panel-google-ak3-read-regs.h"
 
 static const struct drm_dsc_config pps_config = {
 	.line_buf_depth = 9,
@@ -99,21 +105,17 @@ static const u8 lhbm_brightness_write_index[FREQUENCY_COUNT][LHBM_BRIGHTNESS_IND
 	{ 0xB0, 0x03, 0xE6, 0x66 }  /* NS60 */
 };
 
-static const u8 lhbm_brightness_read_index[FREQUENCY_COUNT][LHBM_BRIGHTNESS_INDEX_SIZE] = {
-	{ 0xB0, 0x00, 0x22, 0xD8 }, /* HS120 */
-	{ 0xB0, 0x00, 0x18, 0xD8 }, /* HS60 */
-	{ 0xB0, 0x00, 0x1D, 0xD8 }  /* NS60 */
-};
-
 static const u8 lhbm_brightness_write_reg = 0x66;
-static const u8 lhbm_brightness_read_reg = 0xD8;
 
 static const struct exynos_dsi_cmd ak3b_off_cmds[] = {
 	EXYNOS_DSI_CMD_SEQ(MIPI_DCS_SET_DISPLAY_OFF),
-	EXYNOS_DSI_CMD_SEQ_DELAY(120, MIPI_DCS_ENTER_SLEEP_MODE), /* sleep in */
+	EXYNOS_DSI_CMD_SEQ(MIPI_DCS_ENTER_SLEEP_MODE), /* sleep in, see AK3B_SLEEP_IN_MS */
 };
 static DEFINE_EXYNOS_CMD_SET(ak3b_off);
 
+/* time the panel needs after sleep in before the rails drop or it is reset */
+#define AK3B_SLEEP_IN_MS 120
+
 static const struct exynos_dsi_cmd ak3b_lp_cmds[] = {
 	EXYNOS_DSI_CMD_SEQ(0xF0, 0x5A, 0x5A), /* test_key_on_f0 */
 	EXYNOS_DSI_CMD_SEQ(0xB9, 0x30), /* TE_SELECT 60Hz */
@@ -185,6 +187,14 @@ static const struct exynos_dsi_cmd ak3b_lhbm_location_cmds[] = {
 };
 static DEFINE_EXYNOS_CMD_SET(ak3b_lhbm_location);
 
+static const struct exynos_dsi_cmd ak3b_aod_without_blink_cmds[] = {
+	EXYNOS_DSI_CMD0(test_key_on_f0),
+	EXYNOS_DSI_CMD_SEQ(0xB0, 0x00, 0x03, 0xBB), /* global para */
+	EXYNOS_DSI_CMD_SEQ(0xBB, 0x01, 0x0C),
+	EXYNOS_DSI_CMD0(test_key_off_f0),
+};
+static DEFINE_EXYNOS_CMD_SET(ak3b_aod_without_blink);
+
 #define LHBM_GAMMA_CMD_SIZE 6
 
 #define LHBM_RATIO_SIZE 3
@@ -231,17 +241,280 @@ u32 lhbm_rgb_ratio[LHBM_OVERDRIVE_GRP_MAX][LHBM_RATIO_SIZE] = {
 	{1018876770, 1017326961, 1018911915},
 };
 
+#define AK3B_REG_SHADOW_MAX 12
+#define AK3B_REG_SHADOW_VAL_MAX 4
+
+/**
+ * struct ak3b_reg_shadow - register contents last sent to the panel
+ * @reg: register address
+ * @offset: global para offset of @val within the register
+ * @len: length of @val
+ * @val: register contents
+ */
+struct ak3b_reg_shadow {
+	u8 reg;
+	u16 offset;
+	u8 len;
+	u8 val[AK3B_REG_SHADOW_VAL_MAX];
+};
+
+/**
+ * struct ak3b_reg_write - register write filtered through the shadow cache
+ * @reg: register address
+ * @offset: global para offset of @val within the register
+ * @len: length of @val
+ * @val: value to write
+ */
+struct ak3b_reg_write {
+	u8 reg;
+	u16 offset;
+	u8 len;
+	u8 val[AK3B_REG_SHADOW_VAL_MAX];
+};
+
+/**
+ * enum ak3b_lhbm_cal_step - LHBM calibration steps run after panel init
+ * @LHBM_CAL_IDLE: no calibration pending
+ * @LHBM_CAL_BRIGHTNESS: read LHBM brightness from OTP
+ * @LHBM_CAL_GAMMA: read LHBM gamma from OTP
+ * @LHBM_CAL_APPLY: send LHBM location, gamma and AOD settings
+ */
+enum ak3b_lhbm_cal_step {
+	LHBM_CAL_IDLE = 0,
+	LHBM_CAL_BRIGHTNESS,
+	LHBM_CAL_GAMMA,
+	LHBM_CAL_APPLY,
+};
+
+#define LHBM_OD_GRAY_MIN 15
+#define LHBM_OD_GRAY_COUNT 256
+#define LHBM_OD_THRESHOLD_COUNT (LHBM_OVERDRIVE_GRP_MAX - LHBM_OVERDRIVE_GRP_6_NIT)
+
+/* upper bound in nits of LHBM_OVERDRIVE_GRP_6_NIT and the following groups */
+static const u32 lhbm_od_threshold_nits[LHBM_OD_THRESHOLD_COUNT] = { 6, 50, 300 };
+
+/**
+ * enum ak3b_lhbm_od_segment - brightness segment of the luminance curve
+ * @LHBM_OD_SEG_NORMAL: normal range, gamma 2.2 curve
+ * @LHBM_OD_SEG_HBM: hbm range, linear curve
+ * @LHBM_OD_SEG_MAX: number of segments
+ */
+enum ak3b_lhbm_od_segment {
+	LHBM_OD_SEG_NORMAL = 0,
+	LHBM_OD_SEG_HBM,
+	LHBM_OD_SEG_MAX
+};
+
 struct ak3b_lhbm_ctl {
 	/** @brt_normal: normal LHBM brightness parameters */
 	u8 brt_normal[FREQUENCY_COUNT][LHBM_BRT_LEN];
 	/** @brt_overdrive: overdrive LHBM brightness parameters */
 	u8 brt_overdrive[FREQUENCY_COUNT][LHBM_OVERDRIVE_GRP_MAX][LHBM_BRT_LEN];
+	/**
+	 * @od_dbv: lowest DBV of each overdrive group boundary, per gray level and
+	 *          brightness segment. Built once by ak3b_lhbm_od_lut_init().
+	 */
+	u16 od_dbv[LHBM_OD_GRAY_COUNT][LHBM_OD_SEG_MAX][LHBM_OD_THRESHOLD_COUNT];
+	/** @od_lut_ready: whether @od_dbv is built */
+	bool od_lut_ready;
 	/** @overdrived: whether LHBM is overdrived */
 	bool overdrived;
 	/** @hist_roi_configured: whether LHBM histogram configuration is done */
 	bool hist_roi_configured;
 };
 
+/**
+ * enum ak3b_op - panel operations with DSI statistics
+ * @AK3B_OP_SET_BRIGHTNESS: set_brightness
+ * @AK3B_OP_CHANGE_FREQUENCY: change_frequency
+ * @AK3B_OP_SET_OP_HZ: set_op_hz
+ * @AK3B_OP_UPDATE_TE2: update_te2
+ * @AK3B_OP_UPDATE_WRCTRLD: update_wrctrld
+ * @AK3B_OP_LHBM: set_local_hbm_mode and set_local_hbm_mode_post
+ * @AK3B_OP_ENABLE: enable
+ * @AK3B_OP_NOLP: set_nolp_mode
+ * @AK3B_OP_MAX: number of operations, also used when none is in progress
+ */
+enum ak3b_op {
+	AK3B_OP_SET_BRIGHTNESS = 0,
+	AK3B_OP_CHANGE_FREQUENCY,
+	AK3B_OP_SET_OP_HZ,
+	AK3B_OP_UPDATE_TE2,
+	AK3B_OP_UPDATE_WRCTRLD,
+	AK3B_OP_LHBM,
+	AK3B_OP_ENABLE,
+	AK3B_OP_NOLP,
+	AK3B_OP_MAX
+};
+
+static const char * const ak3b_op_names[AK3B_OP_MAX] = {
+	[AK3B_OP_SET_BRIGHTNESS] = "ak3b_set_brightness",
+	[AK3B_OP_CHANGE_FREQUENCY] = "ak3b_change_frequency",
+	[AK3B_OP_SET_OP_HZ] = "ak3b_set_op_hz",
+	[AK3B_OP_UPDATE_TE2] = "ak3b_update_te2",
+	[AK3B_OP_UPDATE_WRCTRLD] = "ak3b_update_wrctrld",
+	[AK3B_OP_LHBM] = "ak3b_lhbm",
+	[AK3B_OP_ENABLE] = "ak3b_enable",
+	[AK3B_OP_NOLP] = "ak3b_set_nolp_mode",
+};
+
+#define AK3B_ENABLE_SEQ_CMDS_MAX 48
+#define AK3B_ENABLE_SEQ_BUF_SIZE 256
+
+/**
+ * struct ak3b_enable_seq - enable commands compiled for the detected panel rev
+ * @cmds: commands to replay, a zero length entry is where DSC is configured
+ * @num_cmds: number of entries in @cmds
+ * @buf: storage of the command payloads
+ * @buf_len: number of bytes used in @buf
+ * @pps_payload: packed PPS
+ * @ready: whether the sequence is compiled
+ */
+struct ak3b_enable_seq {
+	struct exynos_dsi_cmd cmds[AK3B_ENABLE_SEQ_CMDS_MAX];
+	u32 num_cmds;
+	u8 buf[AK3B_ENABLE_SEQ_BUF_SIZE];
+	u32 buf_len;
+	struct drm_dsc_picture_parameter_set pps_payload;
+	bool ready;
+};
+
+enum frequency { HS120, HS60, NS60, AOD };
+static const char* frequency_str[] = { "HS120", "HS60", "NS60", "AOD" };
+
+/* idle thresholds, in frames at 120hz */
+#define AK3B_IDLE_HS60_FRAMES 30
+#define AK3B_IDLE_NS60_FRAMES 240
+
+/**
+ * struct ak3b_idle - refresh rate step-down on static content
+ * @work: steps the refresh rate down once a threshold expires
+ * @boost_work: restores HS120 after a touch event
+ * @handler: input handler of the touch device
+ * @touch_np: touch device node from the "touch" phandle
+ * @freq: frequency the panel stepped down to, HS120 if it didn't
+ * @last_update: time of the last commit
+ * @last_touch: time of the last touch event
+ * @hs60_frames: idle frames before stepping down to HS60, 0 to skip HS60
+ * @ns60_frames: idle frames before stepping down to NS60, 0 to skip NS60
+ */
+struct ak3b_idle {
+	struct delayed_work work;
+	struct work_struct boost_work;
+	struct input_handler handler;
+	struct device_node *touch_np;
+	enum frequency freq;
+	ktime_t last_update;
+	ktime_t last_touch;
+	u32 hs60_frames;
+	u32 ns60_frames;
+};
+
+/* touch-down distance from the UDFPS center, in pixels, which pre-stages LHBM */
+#define AK3B_UDFPS_TOUCH_RADIUS 150
+/* a pre-staged LHBM brightness is used if LHBM is enabled within this time */
+#define AK3B_UDFPS_STAGE_MS 300
+/* LHBM gray level sampling period while UDFPS is armed */
+#define AK3B_UDFPS_GRAY_PERIOD_MS 100
+/* a sampled gray level older than this is read again at LHBM enable */
+#define AK3B_UDFPS_GRAY_STALE_MS 200
+
+/**
+ * struct ak3b_udfps - LHBM pre-staging on touch-down over the fingerprint sensor
+ * @work: pre-stages the LHBM brightness
+ * @armed: pre-stage on touch-down, set from userspace while UDFPS is listening
+ * @has_location: whether @x and @y were read from the touch device node
+ * @x: UDFPS center x from the touch device node
+ * @y: UDFPS center y from the touch device node
+ * @lock: protects @slot, @down_slot, @down_x, @down_y, @down_time and
+ *        @touch_slot, which are updated from the input event handler in atomic
+ *        context
+ * @slot: current multi-touch slot
+ * @down_slot: slot of the new contact in the current input frame, -1 if none
+ * @down_x: x of the new contact
+ * @down_y: y of the new contact
+ * @down_time: time of the last touch-down over the sensor, read by @work
+ * @touch_slot: slot of the contact over the sensor, -1 once it lifted
+ * @staged: the panel holds the LHBM brightness for the next enable, protected
+ *          by mode_lock
+ * @staged_time: time the LHBM brightness was staged
+ * @staged_freq: frequency the LHBM brightness was staged for
+ * @staged_dbv: DBV the overdrive group was picked for
+ * @stages: number of pre-staged LHBM enables
+ * @hits: number of LHBM enables which used the pre-staged brightness
+ * @gray_work: samples the LHBM gray level while @armed and the panel is on
+ * @gray_lock: serializes the LHBM gray level reads, taken after mode_lock
+ * @gray: last sampled LHBM gray level, protected by mode_lock
+ * @gray_time: time @gray was sampled, 0 if none
+ * @gray_hits: number of LHBM enables which used @gray
+ * @gray_misses: number of LHBM enables which read the gray level
+ */
+struct ak3b_udfps {
+	struct work_struct work;
+	bool armed;
+	bool has_location;
+	u32 x;
+	u32 y;
+	spinlock_t lock;
+	int slot;
+	int down_slot;
+	int down_x;
+	int down_y;
+	ktime_t down_time;
+	int touch_slot;
+	bool staged;
+	ktime_t staged_time;
+	enum frequency staged_freq;
+	u16 staged_dbv;
+	u64 stages;
+	u64 hits;
+	struct delayed_work gray_work;
+	struct mutex gray_lock;
+	int gray;
+	ktime_t gray_time;
+	u64 gray_hits;
+	u64 gray_misses;
+};
+
+/**
+ * enum ak3b_deferred_write - writes which can wait for the blanking window
+ * @AK3B_DEFER_TE2: TE2 timing
+ * @AK3B_DEFER_SSC: spread spectrum clocking
+ * @AK3B_DEFER_WRCTRLD: write control display on dimming changes
+ * @AK3B_DEFER_MAX: number of deferrable writes
+ */
+enum ak3b_deferred_write {
+	AK3B_DEFER_TE2,
+	AK3B_DEFER_SSC,
+	AK3B_DEFER_WRCTRLD,
+	AK3B_DEFER_MAX,
+};
+
+/* blanking windows missed before the deferred writes go out anyway */
+#define AK3B_DEFER_RETRIES 1
+
+/**
+ * struct ak3b_deferred - non-urgent writes waiting for the blanking window
+ * @work: writes the pending registers in the next blanking window
+ * @pending: bitmask of enum ak3b_deferred_write
+ * @flushing: the pending writes are being written
+ * @deferred: number of deferred writes
+ * @merged: number of deferred writes folded into a pending or urgent write
+ * @batches: number of blanking windows used
+ * @missed: number of blanking windows missed before the writes started
+ * @overrun: number of batches which ended after the blanking window
+ */
+struct ak3b_deferred {
+	struct work_struct work;
+	unsigned long pending;
+	bool flushing;
+	u64 deferred;
+	u64 merged;
+	u64 batches;
+	u64 missed;
+	u64 overrun;
+};
+
 /**
  * struct ak3b_panel - panel specific runtime info
  *
@@ -263,14 +536,199 @@ struct ak3b_panel {
 	/** @lhbm_ctl: lhbm brightness control */
 	struct ak3b_lhbm_ctl lhbm_ctl;
 
+	/** @lhbm_cal_step: next LHBM calibration step, protected by mode_lock */
+	enum ak3b_lhbm_cal_step lhbm_cal_step;
+	/** @lhbm_cal_work: runs the LHBM calibration without blocking panel init */
+	struct work_struct lhbm_cal_work;
+
+	/** @enable_seq: enable sequence compiled at panel init */
+	struct ak3b_enable_seq enable_seq;
+
+	/** @brt: brightness writes coalesced and ramped by the driver */
+	struct ak3_brightness brt;
+
+	/** @op_stat: statistics per operation, referenced by @op_stats */
+	struct ak3_op_stat op_stat[AK3B_OP_MAX];
+	/** @op_stats: operation statistics of this panel */
+	struct ak3_op_stats op_stats;
+
 	/** @needs_display_on: if display_on command needs to send after flip done */
 	bool needs_display_on;
+	/** @display_on_commit: first commit after enable, held by @display_on_work */
+	struct drm_crtc_commit *display_on_commit;
+	/** @display_on_work: sends display_on once @display_on_commit is flipped */
+	struct work_struct display_on_work;
+	/** @sleep_in_deadline: time the panel completes the last sleep in */
+	ktime_t sleep_in_deadline;
+
+	/** @reg_shadow: registers last sent to the panel, see ak3b_buf_add_reg_writes() */
+	struct ak3b_reg_shadow reg_shadow[AK3B_REG_SHADOW_MAX];
+	/** @num_reg_shadow: number of valid entries in @reg_shadow */
+	u8 num_reg_shadow;
+	/** @idle: refresh rate step-down state, protected by mode_lock */
+	struct ak3b_idle idle;
+	/** @deferred: deferred writes, protected by mode_lock */
+	struct ak3b_deferred deferred;
+	/** @udfps: LHBM pre-staging from touch events */
+	struct ak3b_udfps udfps;
 };
 
 #define to_spanel(ctx) container_of(ctx, struct ak3b_panel, base)
 
-enum frequency { HS120, HS60, NS60, AOD };
-static const char* frequency_str[] = { "HS120", "HS60", "NS60", "AOD" };
+static void ak3b_lhbm_cal_finish(struct exynos_panel *ctx);
+
+static void ak3b_op_begin(struct exynos_panel *ctx, struct ak3_op_scope *scope,
+			  enum ak3b_op op)
+{
+	ak3_op_begin(&to_spanel(ctx)->op_stats, scope, op);
+}
+
+static void ak3b_op_end(struct exynos_panel *ctx, const struct ak3_op_scope *scope)
+{
+	ak3_op_end(&to_spanel(ctx)->op_stats, scope);
+}
+
+#define AK3B_REG_WRITE(_reg, _offset, seq...) ((struct ak3b_reg_write) {	\
+	.reg = _reg,								\
+	.offset = _offset,							\
+	.len = sizeof((u8[]){ seq }),						\
+	.val = { seq },								\
+})
+
+static struct ak3b_reg_shadow *ak3b_reg_shadow_get(struct ak3b_panel *spanel,
+						   u8 reg, u16 offset, bool alloc)
+{
+	struct ak3b_reg_shadow *shadow;
+	int i;
+
+	for (i = 0; i < spanel->num_reg_shadow; i++) {
+		shadow = &spanel->reg_shadow[i];
+		if (shadow->reg == reg && shadow->offset == offset)
+			return shadow;
+	}
+
+	if (!alloc || spanel->num_reg_shadow >= AK3B_REG_SHADOW_MAX)
+		return NULL;
+
+	shadow = &spanel->reg_shadow[spanel->num_reg_shadow++];
+	shadow->reg = reg;
+	shadow->offset = offset;
+	shadow->len = 0;
+
+	return shadow;
+}
+
+static void ak3b_reg_shadow_set(struct ak3b_panel *spanel, u8 reg, u16 offset,
+				const u8 *val, u8 len)
+{
+	struct ak3b_reg_shadow *shadow;
+
+	if (WARN_ON(len > AK3B_REG_SHADOW_VAL_MAX))
+		return;
+
+	shadow = ak3b_reg_shadow_get(spanel, reg, offset, true);
+	if (!shadow)
+		return;
+
+	memcpy(shadow->val, val, len);
+	shadow->len = len;
+}
+
+static void ak3b_reg_shadow_invalidate(struct ak3b_panel *spanel)
+{
+	spanel->num_reg_shadow = 0;
+}
+
+/*
+ * Find the range of bytes in @w which differ from the panel register contents.
+ * Returns false if the panel already holds the value of @w.
+ */
+static bool ak3b_reg_shadow_diff(struct ak3b_panel *spanel, const struct ak3b_reg_write *w,
+				 int *first, int *last)
+{
+	const struct ak3b_reg_shadow *shadow =
+		ak3b_reg_shadow_get(spanel, w->reg, w->offset, false);
+
+	*first = 0;
+	*last = w->len - 1;
+
+	if (!shadow || shadow->len != w->len)
+		return true;
+
+	while (*first <= *last && shadow->val[*first] == w->val[*first])
+		(*first)++;
+	if (*first > *last)
+		return false;
+
+	while (shadow->val[*last] == w->val[*last])
+		(*last)--;
+
+	return true;
+}
+
+/**
+ * ak3b_buf_add_reg_writes() - queue register writes which change panel state
+ * @ctx: panel struct
+ * @writes: register writes
+ * @count: number of entries in @writes
+ * @flush: flush along with the closing test key
+ *
+ * Compare each write against the last value sent to the same register and global
+ * para offset, and queue only the bytes that changed. The queued writes are
+ * bracketed by the test key and followed by freq_update. Nothing is queued if
+ * the panel already holds all the values. Unless @flush is set, the caller is
+ * responsible to flush.
+ *
+ * Return: true if any command was queued.
+ */
+static bool ak3b_buf_add_reg_writes(struct exynos_panel *ctx,
+				    const struct ak3b_reg_write *writes, int count, bool flush)
+{
+	struct mipi_dsi_device *dsi = to_mipi_dsi_device(ctx->dev);
+	struct ak3b_panel *spanel = to_spanel(ctx);
+	u8 buf[AK3B_REG_SHADOW_VAL_MAX + 1];
+	bool queued = false;
+	int i, first, last, ret;
+	u16 offset;
+
+	for (i = 0; i < count; i++) {
+		const struct ak3b_reg_write *w = &writes[i];
+
+		if (!ak3b_reg_shadow_diff(spanel, w, &first, &last))
+			continue;
+
+		if (!queued) {
+			EXYNOS_DCS_BUF_ADD_SET(ctx, test_key_on_f0);
+			queued = true;
+		}
+
+		offset = w->offset + first;
+		if (offset)
+			EXYNOS_DCS_BUF_ADD(ctx, 0xB0, offset >> 8, offset & 0xFF, w->reg);
+
+		buf[0] = w->reg;
+		memcpy(&buf[1], &w->val[first], last - first + 1);
+		ret = exynos_dsi_dcs_write_buffer(dsi, buf, last - first + 2,
+						  EXYNOS_DSI_MSG_QUEUE);
+		if (ret < 0) {
+			dev_err(ctx->dev, "failed to queue reg 0x%02x+0x%x (%d)\n",
+				w->reg, offset, ret);
+			continue;
+		}
+
+		ak3b_reg_shadow_set(spanel, w->reg, w->offset, w->val, w->len);
+	}
+
+	if (queued) {
+		EXYNOS_DCS_BUF_ADD_SET(ctx, freq_update);
+		if (flush)
+			EXYNOS_DCS_BUF_ADD_SET_AND_FLUSH(ctx, test_key_off_f0);
+		else
+			EXYNOS_DCS_BUF_ADD_SET(ctx, test_key_off_f0);
+	}
+
+	return queued;
+}
 
 static u8 get_lhbm_read_cmd(struct exynos_panel *ctx, enum frequency freq) {
 	switch(freq) {
@@ -287,95 +745,106 @@ static u8 get_lhbm_read_cmd(struct exynos_panel *ctx, enum frequency freq) {
 	}
 }
 
-static void read_lhbm_gamma(struct exynos_panel *ctx, u8 *cmd, enum frequency freq) {
-	struct mipi_dsi_device *dsi = to_mipi_dsi_device(ctx->dev);
-	u8 index = get_lhbm_read_cmd(ctx, freq);
-	int ret;
+static int ak3b_lhbm_gamma_read(struct exynos_panel *ctx)
+{
+	struct ak3b_panel *spanel = to_spanel(ctx);
+	const enum frequency freqs[] = {
+		HS120, NS60, ctx->panel_rev == PANEL_REV_PROTO1 ? AOD : HS60
+	};
+	u8 *cmds[] = {
+		spanel->local_hbm_gamma.hs120_cmd,
+		spanel->local_hbm_gamma.ns_cmd,
+		ctx->panel_rev == PANEL_REV_PROTO1 ? spanel->local_hbm_gamma.aod_cmd :
+						     spanel->local_hbm_gamma.hs60_cmd,
+	};
+	struct ak3_reg_read reads[ARRAY_SIZE(freqs)];
+	u8 buf[ARRAY_SIZE(freqs)][LHBM_GAMMA_CMD_SIZE - 1];
+	u32 failed;
+	int i, ret;
+
+	for (i = 0; i < ARRAY_SIZE(freqs); i++) {
+		reads[i].offset = get_lhbm_read_cmd(ctx, freqs[i]);
+		reads[i].reg = 0xD8;
+		reads[i].len = LHBM_GAMMA_CMD_SIZE - 1;
+	}
 
-	EXYNOS_DCS_BUF_ADD_AND_FLUSH(ctx, 0xB0, 0x00, index, 0xD8); /* global para */
-	ret = mipi_dsi_dcs_read(dsi, 0xD8, cmd + 1, LHBM_GAMMA_CMD_SIZE - 1);
+	ret = ak3_read_regs(ctx, reads, ARRAY_SIZE(reads), &buf[0][0], &failed);
 
-	if (ret != (LHBM_GAMMA_CMD_SIZE - 1)) {
-		dev_err(ctx->dev, "fail to read LHBM gamma for %s\n", frequency_str[freq]);
-		return;
+	for (i = 0; i < ARRAY_SIZE(freqs); i++) {
+		if (failed & BIT(i)) {
+			dev_err(ctx->dev, "fail to read LHBM gamma for %s\n",
+				frequency_str[freqs[i]]);
+			continue;
+		}
+
+		/* fill in gamma write command 0x66 in offset 0 */
+		cmds[i][0] = 0x66;
+		memcpy(cmds[i] + 1, buf[i], LHBM_GAMMA_CMD_SIZE - 1);
+		dev_info(ctx->dev, "%s_gamma: %*ph\n", frequency_str[freqs[i]],
+			LHBM_GAMMA_CMD_SIZE - 1, cmds[i] + 1);
 	}
 
-	/* fill in gamma write command 0x66 in offset 0 */
-	cmd[0] = 0x66;
-	dev_info(ctx->dev, "%s_gamma: %*ph\n", frequency_str[freq],
-		LHBM_GAMMA_CMD_SIZE - 1, cmd + 1);
+	return ret;
 }
 
-static void ak3b_lhbm_gamma_read(struct exynos_panel *ctx)
-{
-	struct ak3b_panel *spanel = to_spanel(ctx);
-
-	EXYNOS_DCS_BUF_ADD_SET(ctx, test_key_on_f0);
+static const u8 lhbm_gamma_write_index[][LHBM_BRIGHTNESS_INDEX_SIZE] = {
+	{ 0xB0, 0x03, 0xD7, 0x66 }, /* HS120 */
+	{ 0xB0, 0x03, 0xDC, 0x66 }, /* HS60 */
+	{ 0xB0, 0x03, 0xE6, 0x66 }, /* NS60 */
+	{ 0xB0, 0x03, 0xEB, 0x66 }, /* AOD */
+};
 
-	read_lhbm_gamma(ctx, spanel->local_hbm_gamma.hs120_cmd, HS120);
-	read_lhbm_gamma(ctx, spanel->local_hbm_gamma.ns_cmd, NS60);
+#define LHBM_GAMMA_WRITE_CMDS_MAX 10
 
-	if (ctx->panel_rev == PANEL_REV_PROTO1) {
-		read_lhbm_gamma(ctx, spanel->local_hbm_gamma.aod_cmd, AOD);
-	} else {
-		read_lhbm_gamma(ctx, spanel->local_hbm_gamma.hs60_cmd, HS60);
+/*
+ * Fill @cmds with the LHBM gamma writes, without the test key bracket.
+ * Return the number of commands, 0 if no LHBM gamma is available.
+ */
+static int ak3b_lhbm_gamma_cmds(struct exynos_panel *ctx, struct exynos_dsi_cmd *cmds)
+{
+	struct ak3b_panel *spanel = to_spanel(ctx);
+	int n = 0;
+
+#define ADD_LHBM_GAMMA_CMDS(freq, gamma) do {					\
+	cmds[n++] = (struct exynos_dsi_cmd)					\
+		EXYNOS_DSI_CMD0(lhbm_gamma_write_index[freq]); /* global para */	\
+	cmds[n++] = (struct exynos_dsi_cmd)EXYNOS_DSI_CMD0(gamma); /* write gamma */	\
+} while (0)
+
+	if (spanel->local_hbm_gamma.hs120_cmd[0]) {
+		ADD_LHBM_GAMMA_CMDS(HS120, spanel->local_hbm_gamma.hs120_cmd);
+		if (ctx->panel_rev == PANEL_REV_PROTO1)
+			ADD_LHBM_GAMMA_CMDS(HS60, spanel->local_hbm_gamma.hs120_cmd);
 	}
+	if (spanel->local_hbm_gamma.hs60_cmd[0])
+		ADD_LHBM_GAMMA_CMDS(HS60, spanel->local_hbm_gamma.hs60_cmd);
+	if (spanel->local_hbm_gamma.ns_cmd[0])
+		ADD_LHBM_GAMMA_CMDS(NS60, spanel->local_hbm_gamma.ns_cmd);
+	if (spanel->local_hbm_gamma.aod_cmd[0])
+		ADD_LHBM_GAMMA_CMDS(AOD, spanel->local_hbm_gamma.aod_cmd);
 
-	EXYNOS_DCS_BUF_ADD_SET_AND_FLUSH(ctx, test_key_off_f0);
+#undef ADD_LHBM_GAMMA_CMDS
+
+	return n;
 }
 
 static void ak3b_lhbm_gamma_write(struct exynos_panel *ctx)
 {
-	struct ak3b_panel *spanel = to_spanel(ctx);
-	const u8 hs120_cmd = spanel->local_hbm_gamma.hs120_cmd[0];
-	const u8 hs60_cmd = spanel->local_hbm_gamma.hs60_cmd[0];
-	const u8 ns_cmd = spanel->local_hbm_gamma.ns_cmd[0];
-	const u8 aod_cmd = spanel->local_hbm_gamma.aod_cmd[0];
+	struct mipi_dsi_device *dsi = to_mipi_dsi_device(ctx->dev);
+	struct exynos_dsi_cmd cmds[LHBM_GAMMA_WRITE_CMDS_MAX];
+	int i, n;
 
-	if (!hs120_cmd && !hs60_cmd && !ns_cmd && !aod_cmd) {
+	n = ak3b_lhbm_gamma_cmds(ctx, cmds);
+	if (!n) {
 		dev_err(ctx->dev, "%s: no lhbm gamma!\n", __func__);
 		return;
 	}
 
 	dev_dbg(ctx->dev, "%s\n", __func__);
 	EXYNOS_DCS_BUF_ADD_SET(ctx, test_key_on_f0);
-
-	if (hs120_cmd) {
-		/* HS120 */
-		EXYNOS_DCS_BUF_ADD(ctx, 0xB0, 0x03, 0xD7, 0x66); /* global para */
-		EXYNOS_DCS_BUF_ADD_SET(ctx, spanel->local_hbm_gamma.hs120_cmd); /* write gamma */
-
-		/* HS60 */
-		if (ctx->panel_rev == PANEL_REV_PROTO1) {
-			EXYNOS_DCS_BUF_ADD(ctx, 0xB0, 0x03, 0xDC, 0x66); /* global para */
-			EXYNOS_DCS_BUF_ADD_SET(ctx,
-				spanel->local_hbm_gamma.hs120_cmd); /* write gamma */
-		}
-	}
-
-	if (hs60_cmd) {
-		EXYNOS_DCS_BUF_ADD(ctx, 0xB0, 0x03, 0xDC, 0x66); /* global para */
-		EXYNOS_DCS_BUF_ADD_SET(ctx, spanel->local_hbm_gamma.hs60_cmd); /* write gamma */
-	}
-
-	if (ns_cmd) {
-		EXYNOS_DCS_BUF_ADD(ctx, 0xB0, 0x03, 0xE6, 0x66); /* global para */
-		EXYNOS_DCS_BUF_ADD_SET(ctx, spanel->local_hbm_gamma.ns_cmd); /* write gamma */
-	}
-
-	if (aod_cmd) {
-		EXYNOS_DCS_BUF_ADD(ctx, 0xB0, 0x03, 0xEB, 0x66); /* global para */
-		EXYNOS_DCS_BUF_ADD_SET(ctx, spanel->local_hbm_gamma.aod_cmd); /* write gamma */
-	}
-
-	EXYNOS_DCS_BUF_ADD_SET_AND_FLUSH(ctx, test_key_off_f0);
-}
-
-static void ak3b_send_aod_without_blink_settings(struct exynos_panel *ctx)
-{
-	EXYNOS_DCS_BUF_ADD_SET(ctx, test_key_on_f0);
-	EXYNOS_DCS_BUF_ADD(ctx, 0xB0, 0x00, 0x03, 0xBB);
-	EXYNOS_DCS_BUF_ADD(ctx, 0xBB, 0x01, 0x0C);
+	for (i = 0; i < n; i++)
+		exynos_dsi_dcs_write_buffer(dsi, cmds[i].cmd, cmds[i].cmd_len,
+					    EXYNOS_DSI_MSG_QUEUE);
 	EXYNOS_DCS_BUF_ADD_SET_AND_FLUSH(ctx, test_key_off_f0);
 }
 
@@ -402,77 +871,202 @@ static void ak3b_get_te2_setting(struct exynos_panel_te2_timing *timing,
 	setting[2] = width_low_byte;
 }
 
+/**
+ * ak3b_defer() - defer a non-urgent write to the next blanking window
+ * @ctx: panel struct
+ * @w: the write
+ *
+ * Writes are only deferred while frames are being transferred. The deferred
+ * write is generated from the panel state when it goes out, so repeated
+ * requests are merged. The caller must hold mode_lock.
+ *
+ * Return: true if the write was deferred, false if it should be written now.
+ */
+static bool ak3b_defer(struct exynos_panel *ctx, enum ak3b_deferred_write w)
+{
+	struct ak3b_deferred *d = &to_spanel(ctx)->deferred;
+	const struct exynos_panel_mode *pmode = ctx->current_mode;
+
+	if (d->flushing || !is_panel_active(ctx) || !pmode || pmode->exynos_mode.is_lp_mode)
+		return false;
+
+	d->deferred++;
+	if (d->pending & BIT(w))
+		d->merged++;
+	d->pending |= BIT(w);
+	schedule_work(&d->work);
+
+	return true;
+}
+
+/* an urgent write supersedes the deferred one, the caller must hold mode_lock */
+static void ak3b_defer_cancel(struct exynos_panel *ctx, enum ak3b_deferred_write w)
+{
+	struct ak3b_deferred *d = &to_spanel(ctx)->deferred;
+
+	if (d->pending & BIT(w)) {
+		d->pending &= ~BIT(w);
+		d->merged++;
+	}
+}
+
 static void ak3b_update_te2(struct exynos_panel *ctx)
 {
+	struct ak3_op_scope scope;
 	struct exynos_panel_te2_timing timing;
-	u8 hs_120hz_setting[4] = {0xCB, 0x00, 0x0C, 0x32};
-	u8 hs_60hz_setting[4] = {0xCB, 0x00, 0x0C, 0x32};
-	u8 lp_setting[4] = {0xCB, 0x00, 0x0C, 0x23}; // lp low/high
+	struct ak3b_reg_write writes[4];
+	u8 setting[3] = {0x00, 0x0C, 0x32};
+	u8 lp_setting[3] = {0x00, 0x0C, 0x23}; // lp low/high
+	int count = 0;
 
 	if (!ctx)
 		return;
 
+	if (ak3b_defer(ctx, AK3B_DEFER_TE2))
+		return;
+	ak3b_defer_cancel(ctx, AK3B_DEFER_TE2);
+
+	writes[count++] = AK3B_REG_WRITE(0xF2, 0x2B, 0x03, 0x14); /* TE2 on */
+
 	/* HS mode */
 	timing = ctx->te2.mode_data[0].timing;
-	ak3b_get_te2_setting(&timing, &hs_120hz_setting[1]);
+	ak3b_get_te2_setting(&timing, setting);
+	writes[count++] = AK3B_REG_WRITE(0xCB, 0x73, setting[0], setting[1], setting[2]);
 
-	dev_dbg(ctx->dev, "TE2 updated HS 120Hz: [HEX] %*ph\n", 4, hs_120hz_setting);
+	dev_dbg(ctx->dev, "TE2 updated HS 120Hz: [HEX] %*ph\n", 3, setting);
 
 	timing = ctx->te2.mode_data[1].timing;
-	ak3b_get_te2_setting(&timing, &hs_60hz_setting[1]);
+	ak3b_get_te2_setting(&timing, setting);
+	writes[count++] = AK3B_REG_WRITE(0xCB, 0xC9, setting[0], setting[1], setting[2]);
 
-	dev_dbg(ctx->dev, "TE2 updated HS 60Hz: [HEX] %*ph\n", 4, hs_60hz_setting);
+	dev_dbg(ctx->dev, "TE2 updated HS 60Hz: [HEX] %*ph\n", 3, setting);
 
 	/* LP mode */
 	if (ctx->current_mode->exynos_mode.is_lp_mode) {
 		int ret = exynos_panel_get_current_mode_te2(ctx, &timing);
 
 		if (!ret)
-			ak3b_get_te2_setting(&timing, &lp_setting[1]);
+			ak3b_get_te2_setting(&timing, lp_setting);
 		else if (ret == -EAGAIN)
 			dev_dbg(ctx->dev,
 				"Panel is not ready, use default setting\n");
 		else
 			return;
 
-		dev_dbg(ctx->dev, "TE2 updated LP: [HEX] %*ph\n", 4, lp_setting);
-	}
+		writes[count++] = AK3B_REG_WRITE(0xCB, 0x1C8, lp_setting[0], lp_setting[1],
+						 lp_setting[2]);
 
-	EXYNOS_DCS_BUF_ADD_SET(ctx, test_key_on_f0);
-	EXYNOS_DCS_BUF_ADD(ctx, 0xB0, 0x00, 0x2B, 0xF2); /* global para */
-	EXYNOS_DCS_BUF_ADD(ctx, 0xF2, 0x03, 0x14); /* TE2 on */
-	EXYNOS_DCS_BUF_ADD(ctx, 0xB0, 0x00, 0x73, 0xCB); /* global para */
-	EXYNOS_DCS_BUF_ADD_SET(ctx, hs_120hz_setting); /* HS 120Hz control */
-	EXYNOS_DCS_BUF_ADD(ctx, 0xB0, 0x00, 0xC9, 0xCB); /* global para */
-	EXYNOS_DCS_BUF_ADD_SET(ctx, hs_60hz_setting); /* HS 60Hz control */
-	if (ctx->current_mode->exynos_mode.is_lp_mode) {
-		EXYNOS_DCS_BUF_ADD(ctx, 0xB0, 0x01, 0xC8, 0xCB); /* global para */
-		EXYNOS_DCS_BUF_ADD_SET(ctx, lp_setting); /* HLPM mode */
+		dev_dbg(ctx->dev, "TE2 updated LP: [HEX] %*ph\n", 3, lp_setting);
 	}
-	EXYNOS_DCS_BUF_ADD_SET(ctx, freq_update); /* LTPS update */
-	EXYNOS_DCS_BUF_ADD_SET_AND_FLUSH(ctx, test_key_off_f0);
+
+	/* only the blocks which changed are sent, nothing if the timings are the same */
+	ak3b_op_begin(ctx, &scope, AK3B_OP_UPDATE_TE2);
+	if (!ak3b_buf_add_reg_writes(ctx, writes, count, true))
+		dev_dbg(ctx->dev, "TE2 unchanged\n");
+	ak3b_op_end(ctx, &scope);
 }
 
-static enum frequency ak3b_get_frequency(struct exynos_panel *ctx)
-{
-	u32 vrefresh = drm_mode_vrefresh(&ctx->current_mode->mode);
+/**
+ * struct ak3b_rate_state - state which determines the panel frequency
+ * @vrefresh: refresh rate of the mode
+ * @op_hz: operating rate
+ * @lp: whether the mode is the LP mode
+ * @idle: frequency stepped down to while idle, HS120 if none
+ * @panel_rev: panel revision
+ */
+struct ak3b_rate_state {
+	u32 vrefresh;
+	u32 op_hz;
+	bool lp;
+	enum frequency idle;
+	u32 panel_rev;
+};
+
+/* frequency select (0x60) and TE select (0xB9) of each frequency */
+static const struct {
+	u8 sel;
+	u8 te_sel;
+} ak3b_rate_regs[] = {
+	[HS120] = { .sel = 0x00, .te_sel = 0x31 },
+	[HS60] = { .sel = 0x08, .te_sel = 0x30 },
+	[NS60] = { .sel = 0x18, .te_sel = 0x30 },
+	/* TE select of ak3b_lp_cmds, the frequency select is kept at HS60 */
+	[AOD] = { .sel = 0x08, .te_sel = 0x30 },
+};
 
-	if (ctx->current_mode->exynos_mode.is_lp_mode)
+/* frequency the panel runs at in state @st */
+static enum frequency ak3b_rate_plan(const struct ak3b_rate_state *st)
+{
+	if (st->lp)
 		return AOD;
-	else if (vrefresh == 120)
-		return HS120;
-	else if (ctx->panel_rev <= PANEL_REV_PROTO1)
+	/* idle only steps down from 120hz */
+	if (st->vrefresh == 120)
+		return st->idle;
+	if (st->op_hz != 60)
 		return HS60;
+	/* NS60 is treated HS60 for Proto 1.0 */
+	if (st->panel_rev <= PANEL_REV_PROTO1)
+		return HS60;
+
+	return NS60;
+}
+
+static void ak3b_rate_state_init(struct exynos_panel *ctx, struct ak3b_rate_state *st,
+				 u32 vrefresh, bool lp)
+{
+	st->vrefresh = vrefresh;
+	st->op_hz = ctx->op_hz;
+	st->lp = lp;
+	st->idle = to_spanel(ctx)->idle.freq;
+	st->panel_rev = ctx->panel_rev;
+}
+
+/* frequency of the current mode and idle state */
+static enum frequency ak3b_rate_current(struct exynos_panel *ctx)
+{
+	const struct exynos_panel_mode *pmode = ctx->current_mode;
+	struct ak3b_rate_state st;
+
+	ak3b_rate_state_init(ctx, &st, drm_mode_vrefresh(&pmode->mode),
+			     pmode->exynos_mode.is_lp_mode);
+
+	return ak3b_rate_plan(&st);
+}
+
+/* frequency of the current mode, regardless of idle */
+static enum frequency ak3b_get_frequency(struct exynos_panel *ctx)
+{
+	const struct exynos_panel_mode *pmode = ctx->current_mode;
+	struct ak3b_rate_state st;
+
+	ak3b_rate_state_init(ctx, &st, drm_mode_vrefresh(&pmode->mode),
+			     pmode->exynos_mode.is_lp_mode);
+	st.idle = HS120;
+
+	return ak3b_rate_plan(&st);
+}
+
+/*
+ * Switch the panel to @freq. The registers go through the shadow, so a
+ * transition only sends the registers which differ and nothing if the panel
+ * already runs at @freq. Returns true if anything was sent.
+ */
+static bool ak3b_rate_apply(struct exynos_panel *ctx, enum frequency freq)
+{
+	const struct ak3b_reg_write writes[] = {
+		AK3B_REG_WRITE(0x60, 0x00, ak3b_rate_regs[freq].sel, 0x00),
+		AK3B_REG_WRITE(0xB9, 0x00, ak3b_rate_regs[freq].te_sel),
+	};
 
-	return ctx->op_hz == 60 ? NS60 : HS60;
+	return ak3b_buf_add_reg_writes(ctx, writes, ARRAY_SIZE(writes), true);
 }
 
 static void ak3b_change_frequency(struct exynos_panel *ctx,
 				    const unsigned int vrefresh)
 {
-	const u8 hs60_setting[3] = {0x60, 0x08, 0x00};
-	const u8 ns60_setting[3] = {0x60, 0x18, 0x00};
-	const u8 hs120_setting[3] = {0x60, 0x00, 0x00};
+	struct ak3b_rate_state st;
+	struct ak3_op_scope scope;
+	enum frequency freq;
 
 	if (unlikely(!ctx))
 		return;
@@ -482,40 +1076,26 @@ static void ak3b_change_frequency(struct exynos_panel *ctx,
 		return;
 	}
 
-	EXYNOS_DCS_BUF_ADD_SET(ctx, test_key_on_f0);
-	if (vrefresh == 120) {
-		EXYNOS_DCS_BUF_ADD_SET(ctx, hs120_setting);
-		EXYNOS_DCS_BUF_ADD(ctx, 0xB9, 0x31);
-	} else {
-		if (ctx->op_hz == 120)
-			EXYNOS_DCS_BUF_ADD_SET(ctx, hs60_setting);
-		else
-			EXYNOS_DCS_BUF_ADD_SET(ctx, ns60_setting);
-
-		EXYNOS_DCS_BUF_ADD(ctx, 0xB9, 0x30);
-	}
-	EXYNOS_DCS_BUF_ADD_SET(ctx, freq_update);
-	EXYNOS_DCS_BUF_ADD_SET_AND_FLUSH(ctx, test_key_off_f0);
-
-	dev_dbg(ctx->dev, "%s: change to %uhz\n", __func__, vrefresh);
-}
-
-static void buf_add_frequency_select_cmd(struct exynos_panel *ctx) {
-	u32 vrefresh = drm_mode_vrefresh(&ctx->current_mode->mode);
-	/* NS60: 0x18, HS120: 0x00, HS60: 0x08 */
-	u8 index = 0x18;
-	if (ctx->op_hz != 60) {
-	    index = (vrefresh == 120) ? 0x00 : 0x08;
-	} else if (ctx->panel_rev <= PANEL_REV_PROTO1) {
-		index = 0x08; /* NS60 is treated HS60 for Proto 1.0 */
-	}
+	/* a mode change leaves the idle frequency */
+	to_spanel(ctx)->idle.freq = HS120;
+	ak3b_rate_state_init(ctx, &st, vrefresh, false);
+	/* a mode change selects NS60 for op_hz 60 on Proto 1.0 too */
+	if (vrefresh == 60 && ctx->op_hz == 60)
+		freq = NS60;
+	else
+		freq = ak3b_rate_plan(&st);
 
-	EXYNOS_DCS_BUF_ADD(ctx, 0x60, index, 0x00);
+	ak3b_op_begin(ctx, &scope, AK3B_OP_CHANGE_FREQUENCY);
+	if (ak3b_rate_apply(ctx, freq))
+		dev_dbg(ctx->dev, "%s: change to %uhz (%s)\n", __func__, vrefresh,
+			frequency_str[freq]);
+	ak3b_op_end(ctx, &scope);
 }
 
 static int ak3b_set_op_hz(struct exynos_panel *ctx, unsigned int hz)
 {
 	const unsigned int vrefresh = drm_mode_vrefresh(&ctx->current_mode->mode);
+	struct ak3_op_scope scope;
 
 	if ((vrefresh > hz) || ((hz != 60) && (hz != 120))) {
 		dev_err(ctx->dev, "invalid op_hz=%u for vrefresh=%u\n",
@@ -531,34 +1111,345 @@ static int ak3b_set_op_hz(struct exynos_panel *ctx, unsigned int hz)
 		return 0;
 	}
 
-	DPU_ATRACE_BEGIN(__func__);
+	ak3b_op_begin(ctx, &scope, AK3B_OP_SET_OP_HZ);
 
-	EXYNOS_DCS_BUF_ADD_SET(ctx, test_key_on_f0);
-	buf_add_frequency_select_cmd(ctx);
-	EXYNOS_DCS_BUF_ADD_SET(ctx, freq_update);
-	EXYNOS_DCS_BUF_ADD_SET_AND_FLUSH(ctx, test_key_off_f0);
+	to_spanel(ctx)->idle.freq = HS120;
+	ak3b_rate_apply(ctx, ak3b_get_frequency(ctx));
 
 	dev_info(ctx->dev, "set op_hz at %u\n", hz);
 
-	DPU_ATRACE_END(__func__);
+	ak3b_op_end(ctx, &scope);
 
 	return 0;
 }
 
-static void ak3b_update_lhbm_hist_config(struct exynos_panel *ctx)
+/* switch the panel refresh rate without a mode change */
+static void ak3b_idle_set_frequency(struct exynos_panel *ctx, enum frequency freq)
 {
 	struct ak3b_panel *spanel = to_spanel(ctx);
-	struct ak3b_lhbm_ctl *ctl = &spanel->lhbm_ctl;
+	struct ak3_op_scope scope;
+
+	spanel->idle.freq = freq;
+
+	ak3b_op_begin(ctx, &scope, AK3B_OP_CHANGE_FREQUENCY);
+	ak3b_rate_apply(ctx, ak3b_rate_current(ctx));
+	ak3b_op_end(ctx, &scope);
+
+	dev_dbg(ctx->dev, "%s: %s\n", __func__, frequency_str[freq]);
+}
+
+static bool ak3b_idle_allowed(struct exynos_panel *ctx)
+{
 	const struct exynos_panel_mode *pmode = ctx->current_mode;
-	const struct drm_display_mode *mode;
 
-	/* From b/270088287#comment1 lhbm center below the center of AA: 521, radius: 99 */
-	const int d = 521, r = 99;
+	return is_panel_active(ctx) && pmode && !pmode->exynos_mode.is_lp_mode &&
+	       drm_mode_vrefresh(&pmode->mode) == 120 && !ctx->hbm.local_hbm.enabled;
+}
 
-	if (ctl->hist_roi_configured)
-		return;
+static unsigned long ak3b_idle_frames_to_jiffies(u32 frames)
+{
+	return usecs_to_jiffies(frames * EXYNOS_VREFRESH_TO_PERIOD_USEC(120));
+}
 
-	if (!pmode) {
+/* restore HS120 and restart the idle timer, the caller must hold mode_lock */
+static void ak3b_idle_kick(struct exynos_panel *ctx)
+{
+	struct ak3b_idle *idle = &to_spanel(ctx)->idle;
+	const u32 frames = idle->hs60_frames ? : idle->ns60_frames;
+
+	idle->last_update = ktime_get();
+	if (idle->freq != HS120 && is_panel_active(ctx))
+		ak3b_idle_set_frequency(ctx, HS120);
+
+	if (frames && ak3b_idle_allowed(ctx))
+		mod_delayed_work(system_wq, &idle->work, ak3b_idle_frames_to_jiffies(frames));
+}
+
+static void ak3b_idle_work(struct work_struct *work)
+{
+	struct ak3b_idle *idle = container_of(to_delayed_work(work), struct ak3b_idle, work);
+	struct ak3b_panel *spanel = container_of(idle, struct ak3b_panel, idle);
+	struct exynos_panel *ctx = &spanel->base;
+	const bool ns60_allowed = idle->ns60_frames && ctx->panel_rev > PANEL_REV_PROTO1;
+	enum frequency next = HS120;
+	ktime_t last;
+	u32 frames, threshold = 0;
+
+	mutex_lock(&ctx->mode_lock);
+	if (!ak3b_idle_allowed(ctx))
+		goto out;
+
+	last = max_t(ktime_t, idle->last_update, READ_ONCE(idle->last_touch));
+	frames = ktime_us_delta(ktime_get(), last) / EXYNOS_VREFRESH_TO_PERIOD_USEC(120);
+
+	if (ns60_allowed && frames >= idle->ns60_frames)
+		next = NS60;
+	else if (idle->hs60_frames && frames >= idle->hs60_frames)
+		next = HS60;
+
+	if (next > idle->freq)
+		ak3b_idle_set_frequency(ctx, next);
+
+	/* wait for the next step down, if any */
+	if (idle->freq < HS60 && idle->hs60_frames > frames)
+		threshold = idle->hs60_frames;
+	else if (idle->freq < NS60 && ns60_allowed && idle->ns60_frames > frames)
+		threshold = idle->ns60_frames;
+	if (threshold)
+		schedule_delayed_work(&idle->work, ak3b_idle_frames_to_jiffies(threshold - frames));
+out:
+	mutex_unlock(&ctx->mode_lock);
+}
+
+static void ak3b_idle_boost_work(struct work_struct *work)
+{
+	struct ak3b_idle *idle = container_of(work, struct ak3b_idle, boost_work);
+	struct ak3b_panel *spanel = container_of(idle, struct ak3b_panel, idle);
+	struct exynos_panel *ctx = &spanel->base;
+
+	mutex_lock(&ctx->mode_lock);
+	if (idle->freq != HS120) {
+		DPU_ATRACE_BEGIN("ak3b_idle_touch_boost");
+		ak3b_idle_kick(ctx);
+		DPU_ATRACE_END("ak3b_idle_touch_boost");
+	}
+	mutex_unlock(&ctx->mode_lock);
+}
+
+/*
+ * Track new contacts of the multi-touch protocol B, a touch-down is qualified once
+ * the input frame completes with its position inside the UDFPS area.
+ */
+static void ak3b_udfps_touch_event(struct ak3b_panel *spanel, unsigned int type,
+				   unsigned int code, int value)
+{
+	struct ak3b_udfps *udfps = &spanel->udfps;
+	unsigned long flags;
+	int slot, dx, dy;
+
+	spin_lock_irqsave(&udfps->lock, flags);
+	if (type == EV_ABS) {
+		switch (code) {
+		case ABS_MT_SLOT:
+			udfps->slot = value;
+			break;
+		case ABS_MT_TRACKING_ID:
+			if (value >= 0) {
+				udfps->down_slot = udfps->slot;
+				udfps->down_x = -1;
+				udfps->down_y = -1;
+			} else if (udfps->slot == udfps->touch_slot) {
+				/* the contact over the sensor lifted */
+				udfps->touch_slot = -1;
+				queue_work(system_highpri_wq, &udfps->work);
+			}
+			break;
+		case ABS_MT_POSITION_X:
+			if (udfps->slot == udfps->down_slot)
+				udfps->down_x = value;
+			break;
+		case ABS_MT_POSITION_Y:
+			if (udfps->slot == udfps->down_slot)
+				udfps->down_y = value;
+			break;
+		default:
+			break;
+		}
+		goto out;
+	}
+
+	if (type != EV_SYN || code != SYN_REPORT || udfps->down_slot < 0)
+		goto out;
+
+	slot = udfps->down_slot;
+	udfps->down_slot = -1;
+	if (udfps->down_x < 0 || udfps->down_y < 0)
+		goto out;
+
+	dx = udfps->down_x - udfps->x;
+	dy = udfps->down_y - udfps->y;
+	if (READ_ONCE(udfps->armed) &&
+	    dx * dx + dy * dy <= AK3B_UDFPS_TOUCH_RADIUS * AK3B_UDFPS_TOUCH_RADIUS) {
+		udfps->down_time = ktime_get();
+		udfps->touch_slot = slot;
+		queue_work(system_highpri_wq, &udfps->work);
+	}
+out:
+	spin_unlock_irqrestore(&udfps->lock, flags);
+}
+
+static bool ak3b_udfps_gray_allowed(struct exynos_panel *ctx)
+{
+	const struct exynos_panel_mode *pmode = ctx->current_mode;
+
+	return READ_ONCE(to_spanel(ctx)->udfps.armed) && is_panel_active(ctx) && pmode &&
+	       !pmode->exynos_mode.is_lp_mode;
+}
+
+/* read the LHBM gray level, the reads of the work and of LHBM enable are serialized */
+static int ak3b_udfps_gray_read(struct exynos_panel *ctx)
+{
+	struct ak3b_udfps *udfps = &to_spanel(ctx)->udfps;
+	int gray;
+
+	mutex_lock(&udfps->gray_lock);
+	gray = exynos_drm_connector_get_lhbm_gray_level(&ctx->exynos_connector);
+	mutex_unlock(&udfps->gray_lock);
+
+	return gray;
+}
+
+/*
+ * Sample the LHBM gray level at a low rate, so that the overdrive decision at
+ * LHBM enable doesn't wait for a histogram. The histogram read waits for a frame,
+ * so it runs without mode_lock and the sample is only kept if sampling is still
+ * allowed once it completes.
+ */
+static void ak3b_udfps_gray_work(struct work_struct *work)
+{
+	struct ak3b_udfps *udfps = container_of(to_delayed_work(work), struct ak3b_udfps,
+						gray_work);
+	struct ak3b_panel *spanel = container_of(udfps, struct ak3b_panel, udfps);
+	struct exynos_panel *ctx = &spanel->base;
+	bool allowed;
+	int gray;
+
+	mutex_lock(&ctx->mode_lock);
+	allowed = ak3b_udfps_gray_allowed(ctx);
+	if (!allowed)
+		udfps->gray_time = 0;
+	mutex_unlock(&ctx->mode_lock);
+	if (!allowed)
+		return;
+
+	gray = ak3b_udfps_gray_read(ctx);
+
+	mutex_lock(&ctx->mode_lock);
+	/* disarmed, turned off or entered LP mode during the read */
+	if (!ak3b_udfps_gray_allowed(ctx)) {
+		udfps->gray_time = 0;
+		goto out;
+	}
+
+	if (gray >= 0) {
+		udfps->gray = gray;
+		udfps->gray_time = ktime_get();
+	}
+	schedule_delayed_work(&udfps->gray_work, msecs_to_jiffies(AK3B_UDFPS_GRAY_PERIOD_MS));
+out:
+	mutex_unlock(&ctx->mode_lock);
+}
+
+/* start sampling if it's not running, the caller must hold mode_lock */
+static void ak3b_udfps_gray_kick(struct exynos_panel *ctx)
+{
+	struct ak3b_udfps *udfps = &to_spanel(ctx)->udfps;
+
+	if (ak3b_udfps_gray_allowed(ctx) && !delayed_work_pending(&udfps->gray_work))
+		schedule_delayed_work(&udfps->gray_work, 0);
+}
+
+/* LHBM gray level for the overdrive decision, the caller must hold mode_lock */
+static int ak3b_lhbm_gray_level(struct exynos_panel *ctx)
+{
+	struct ak3b_udfps *udfps = &to_spanel(ctx)->udfps;
+
+	if (udfps->gray_time &&
+	    ktime_ms_delta(ktime_get(), udfps->gray_time) <= AK3B_UDFPS_GRAY_STALE_MS) {
+		udfps->gray_hits++;
+		return udfps->gray;
+	}
+
+	udfps->gray_misses++;
+	return ak3b_udfps_gray_read(ctx);
+}
+
+static void ak3b_touch_event(struct input_handle *handle, unsigned int type,
+			     unsigned int code, int value)
+{
+	struct ak3b_panel *spanel = handle->private;
+
+	if (spanel->udfps.has_location)
+		ak3b_udfps_touch_event(spanel, type, code, value);
+
+	WRITE_ONCE(spanel->idle.last_touch, ktime_get());
+	/* boost from a high priority worker, the write goes out before the next TE */
+	if (READ_ONCE(spanel->idle.freq) != HS120)
+		queue_work(system_highpri_wq, &spanel->idle.boost_work);
+}
+
+static int ak3b_touch_connect(struct input_handler *handler, struct input_dev *dev,
+			      const struct input_device_id *id)
+{
+	struct ak3b_panel *spanel = handler->private;
+	struct input_handle *handle;
+	struct device *parent;
+	int ret;
+
+	/* only the touch device linked to the panel */
+	for (parent = dev->dev.parent; parent; parent = parent->parent)
+		if (parent->of_node == spanel->idle.touch_np)
+			break;
+	if (!parent)
+		return -ENODEV;
+
+	handle = kzalloc(sizeof(*handle), GFP_KERNEL);
+	if (!handle)
+		return -ENOMEM;
+
+	handle->dev = dev;
+	handle->handler = handler;
+	handle->name = handler->name;
+	handle->private = spanel;
+
+	ret = input_register_handle(handle);
+	if (ret)
+		goto err_free;
+
+	ret = input_open_device(handle);
+	if (ret)
+		goto err_unregister;
+
+	dev_info(spanel->base.dev, "touch boost on %s\n", dev->name);
+	return 0;
+
+err_unregister:
+	input_unregister_handle(handle);
+err_free:
+	kfree(handle);
+	return ret;
+}
+
+static void ak3b_touch_disconnect(struct input_handle *handle)
+{
+	input_close_device(handle);
+	input_unregister_handle(handle);
+	kfree(handle);
+}
+
+static const struct input_device_id ak3b_touch_ids[] = {
+	{
+		.flags = INPUT_DEVICE_ID_MATCH_EVBIT | INPUT_DEVICE_ID_MATCH_ABSBIT,
+		.evbit = { BIT_MASK(EV_ABS) },
+		.absbit = { [BIT_WORD(ABS_MT_POSITION_X)] = BIT_MASK(ABS_MT_POSITION_X) },
+	},
+	{ },
+};
+
+static void ak3b_update_lhbm_hist_config(struct exynos_panel *ctx)
+{
+	struct ak3b_panel *spanel = to_spanel(ctx);
+	struct ak3b_lhbm_ctl *ctl = &spanel->lhbm_ctl;
+	const struct exynos_panel_mode *pmode = ctx->current_mode;
+	const struct drm_display_mode *mode;
+
+	/* From b/270088287#comment1 lhbm center below the center of AA: 521, radius: 99 */
+	const int d = 521, r = 99;
+
+	if (ctl->hist_roi_configured)
+		return;
+
+	if (!pmode) {
 		dev_err(ctx->dev, "no current mode set\n");
 		return;
 	}
@@ -621,27 +1512,64 @@ static void ak3b_commit_done(struct exynos_panel *ctx)
 		return;
 	}
 
-	if (!is_panel_active(ctx) || !spanel->needs_display_on)
+	if (!is_panel_active(ctx))
+		return;
+
+	/* new content, go back to HS120 and restart the idle timer */
+	ak3b_idle_kick(ctx);
+	ak3b_udfps_gray_kick(ctx);
+
+	/* resume calibration if the panel was not active yet when it got scheduled */
+	if (spanel->lhbm_cal_step != LHBM_CAL_IDLE)
+		schedule_work(&spanel->lhbm_cal_work);
+
+	/* later commits don't need to wait, the first flip turns the display on */
+	if (!spanel->needs_display_on || spanel->display_on_commit)
 		return;
 
 	commit = ctx->crtc->state->commit;
+	spanel->display_on_commit = drm_crtc_commit_get(commit);
+	schedule_work(&spanel->display_on_work);
+}
+
+static void ak3b_display_on_work(struct work_struct *work)
+{
+	struct ak3b_panel *spanel = container_of(work, struct ak3b_panel, display_on_work);
+	struct exynos_panel *ctx = &spanel->base;
+	struct drm_crtc_commit *commit = spanel->display_on_commit;
 
 	DPU_ATRACE_BEGIN("ak3b_wait_for_flip_done");
 	if (!wait_for_completion_timeout(&commit->flip_done, msecs_to_jiffies(100)))
 		dev_warn(ctx->dev, "timeout when waiting for flip done\n");
 	DPU_ATRACE_END("ak3b_wait_for_flip_done");
 
-	EXYNOS_DCS_BUF_ADD_AND_FLUSH(ctx, MIPI_DCS_SET_DISPLAY_ON);
+	mutex_lock(&ctx->mode_lock);
+	/* the panel may have been disabled while waiting */
+	if (is_panel_active(ctx) && spanel->needs_display_on) {
+		EXYNOS_DCS_BUF_ADD_AND_FLUSH(ctx, MIPI_DCS_SET_DISPLAY_ON);
+		spanel->needs_display_on = false;
+		dev_info(ctx->dev, "%s: DISPLAY_ON\n", __func__);
+	}
+	spanel->display_on_commit = NULL;
+	mutex_unlock(&ctx->mode_lock);
 
-	spanel->needs_display_on = false;
+	drm_crtc_commit_put(commit);
+}
 
-	dev_info(ctx->dev, "%s: DISPLAY_ON\n", __func__);
+static void ak3b_cancel_display_on(struct ak3b_panel *spanel)
+{
+	/* release the commit if the work didn't get to run */
+	if (cancel_work_sync(&spanel->display_on_work)) {
+		drm_crtc_commit_put(spanel->display_on_commit);
+		spanel->display_on_commit = NULL;
+	}
 }
 
 static void ak3b_update_wrctrld(struct exynos_panel *ctx)
 {
 	u8 val = AK3B_WRCTRLD_BCTRL_BIT;
 	enum frequency freq = ak3b_get_frequency(ctx);
+	struct ak3_op_scope scope;
 
 	if (IS_HBM_ON(ctx->hbm_mode))
 		val |= AK3B_WRCTRLD_HBM_BIT;
@@ -649,59 +1577,80 @@ static void ak3b_update_wrctrld(struct exynos_panel *ctx)
 	if (ctx->hbm.local_hbm.enabled)
 		val |= AK3B_WRCTRLD_LOCAL_HBM_BIT;
 
-	if (ctx->dimming_on)
+	if (ctx->dimming_on || to_spanel(ctx)->brt.ramp.hw_dimming)
 		val |= AK3B_WRCTRLD_DIMMING_BIT;
 
+	ak3b_defer_cancel(ctx, AK3B_DEFER_WRCTRLD);
+
 	dev_dbg(ctx->dev,
 		"%s(wrctrld:0x%x, hbm: %s, dimming: %s, local_hbm: %s)\n",
 		__func__, val, IS_HBM_ON(ctx->hbm_mode) ? "on" : "off",
 		ctx->dimming_on ? "on" : "off",
 		ctx->hbm.local_hbm.enabled ? "on" : "off");
 
-	/* pulse settings */
+	ak3b_op_begin(ctx, &scope, AK3B_OP_UPDATE_WRCTRLD);
+
+	/* pulse settings, only the registers which changed are sent */
 	if (ctx->panel_rev >= PANEL_REV_PROTO1_1) {
-		EXYNOS_DCS_BUF_ADD_SET(ctx, test_key_on_f0);
+		struct ak3b_reg_write writes[4];
+		int count = 0;
 
 		if (ctx->panel_rev >= PANEL_REV_EVT1) {
-			EXYNOS_DCS_BUF_ADD(ctx, 0xB0, 0x00, 0x0B, 0xF2);
-
 			if (ctx->hbm.local_hbm.enabled && freq == HS60)
-				EXYNOS_DCS_BUF_ADD(ctx, 0xF2, 0x0C, 0x09, 0xB4);
+				writes[count++] = AK3B_REG_WRITE(0xF2, 0x0B, 0x0C, 0x09, 0xB4);
 			else
-				EXYNOS_DCS_BUF_ADD(ctx, 0xF2, 0x0C, 0x00, 0x24);
+				writes[count++] = AK3B_REG_WRITE(0xF2, 0x0B, 0x0C, 0x00, 0x24);
 		}
 
-		EXYNOS_DCS_BUF_ADD(ctx, 0xB0, 0x00, 0x01, 0xBD);
 		if (ctx->hbm.local_hbm.enabled) {
-			EXYNOS_DCS_BUF_ADD(ctx, 0xBD, 0x00, 0x01, 0x01, 0x01);
-			if (ctx->panel_rev >= PANEL_REV_EVT1) {
-				EXYNOS_DCS_BUF_ADD(ctx, 0xB0, 0x00, 0x2F, 0xBD);
-				EXYNOS_DCS_BUF_ADD(ctx, 0xBD, (freq == HS60 ? 0x00 : 0x02));
-			}
+			writes[count++] = AK3B_REG_WRITE(0xBD, 0x01, 0x00, 0x01, 0x01, 0x01);
+			if (ctx->panel_rev >= PANEL_REV_EVT1)
+				writes[count++] = AK3B_REG_WRITE(0xBD, 0x2F,
+								 freq == HS60 ? 0x00 : 0x02);
 		} else {
 			if (ctx->panel_rev >= PANEL_REV_EVT1) {
-				EXYNOS_DCS_BUF_ADD(ctx, 0xBD, 0x81, 0x01, 0x03, 0x03);
-				EXYNOS_DCS_BUF_ADD(ctx, 0xB0, 0x00, 0x2F, 0xBD);
+				writes[count++] = AK3B_REG_WRITE(0xBD, 0x01, 0x81, 0x01, 0x03, 0x03);
 				/* HS 120Hz, HS 60Hz, NS 60Hz */
-				EXYNOS_DCS_BUF_ADD(ctx, 0xBD, 0x02);
+				writes[count++] = AK3B_REG_WRITE(0xBD, 0x2F, 0x02);
 			} else {
-				EXYNOS_DCS_BUF_ADD(ctx, 0xBD, 0x01, 0x03, 0x03, 0x03);
+				writes[count++] = AK3B_REG_WRITE(0xBD, 0x01, 0x01, 0x03, 0x03, 0x03);
 			}
 
-			buf_add_frequency_select_cmd(ctx);
+			writes[count++] = AK3B_REG_WRITE(0x60, 0x00,
+							 ak3b_rate_regs[ak3b_rate_current(ctx)].sel,
+							 0x00);
 		}
 
-		EXYNOS_DCS_BUF_ADD_SET(ctx, freq_update);
-		EXYNOS_DCS_BUF_ADD_SET(ctx, test_key_off_f0);
+		ak3b_buf_add_reg_writes(ctx, writes, count, false);
 	}
 
 	EXYNOS_DCS_BUF_ADD_AND_FLUSH(ctx, MIPI_DCS_WRITE_CONTROL_DISPLAY, val);
+
+	ak3b_op_end(ctx, &scope);
 }
 
+static int ak3b_write_brightness(struct exynos_panel *ctx, u16 br)
+{
+	struct ak3_op_scope scope;
+	u16 brightness = (br & 0xff) << 8 | br >> 8;
+	int ret;
+
+	ak3b_op_begin(ctx, &scope, AK3B_OP_SET_BRIGHTNESS);
+	ret = exynos_dcs_set_brightness(ctx, brightness);
+	ak3b_op_end(ctx, &scope);
+
+	return ret;
+}
+
+static const struct ak3_brightness_funcs ak3b_brightness_funcs = {
+	.write = ak3b_write_brightness,
+	.update_wrctrld = ak3b_update_wrctrld,
+};
+
 #define MAX_BR_HBM 4095
 static int ak3b_set_brightness(struct exynos_panel *ctx, u16 br)
 {
-	u16 brightness;
+	struct ak3b_panel *spanel = to_spanel(ctx);
 
 	if (ctx->current_mode->exynos_mode.is_lp_mode) {
 		const struct exynos_panel_funcs *funcs;
@@ -718,9 +1667,15 @@ static int ak3b_set_brightness(struct exynos_panel *ctx, u16 br)
 			__func__, MAX_BR_HBM);
 	}
 
-	brightness = (br & 0xff) << 8 | br >> 8;
+	return ak3_brightness_set(&spanel->brt, br);
+}
 
-	return exynos_dcs_set_brightness(ctx, brightness);
+static void ak3b_set_lp_mode(struct exynos_panel *ctx, const struct exynos_panel_mode *pmode)
+{
+	exynos_panel_set_lp_mode(ctx, pmode);
+	/* the LP commands selected the 60Hz TE, the shadow stays unknown if not sent */
+	if (is_panel_active(ctx))
+		ak3b_reg_shadow_set(to_spanel(ctx), 0xB9, 0, &ak3b_rate_regs[AOD].te_sel, 1);
 }
 
 static void ak3b_set_nolp_mode(struct exynos_panel *ctx,
@@ -730,15 +1685,15 @@ static void ak3b_set_nolp_mode(struct exynos_panel *ctx,
 	unsigned int aod_vrefresh = current_mode ? drm_mode_vrefresh(&current_mode->mode) : 30;
 	unsigned int new_vrefresh = drm_mode_vrefresh(&pmode->mode);
 	unsigned int aod_te_usec = current_mode ? current_mode->exynos_mode.te_usec : 460;
+	struct ak3_op_scope scope;
 
 	if (!is_panel_active(ctx))
 		return;
 
-	/* HS60 settings */
-	EXYNOS_DCS_BUF_ADD_SET(ctx, test_key_on_f0);
-	EXYNOS_DCS_BUF_ADD(ctx, 0x60, 0x08, 0x00);
-	EXYNOS_DCS_BUF_ADD(ctx, 0xF7, 0x0F);
-	EXYNOS_DCS_BUF_ADD_SET_AND_FLUSH(ctx, test_key_off_f0);
+	ak3b_op_begin(ctx, &scope, AK3B_OP_NOLP);
+
+	/* leave AOD from HS60 */
+	ak3b_rate_apply(ctx, HS60);
 
 	/* AOD off setting */
 	EXYNOS_DCS_BUF_ADD_SET(ctx, test_key_on_f0);
@@ -754,9 +1709,156 @@ static void ak3b_set_nolp_mode(struct exynos_panel *ctx,
 	usleep_range(1000, 1010);
 	DPU_ATRACE_END("ak3b_wait_one_vblank");
 
+	ak3b_op_end(ctx, &scope);
 	dev_info(ctx->dev, "exit LP mode\n");
 }
 
+static bool ak3b_is_test_key(const u8 *cmd, u32 len, u8 val)
+{
+	return len == 3 && (cmd[0] == 0xF0 || cmd[0] == 0xF1 || cmd[0] == 0xFC) &&
+	       cmd[1] == val && cmd[2] == val;
+}
+
+static int ak3b_enable_seq_add(struct ak3b_enable_seq *seq, const u8 *cmd, u32 len,
+			       u32 delay_ms)
+{
+	struct exynos_dsi_cmd *last = seq->num_cmds ? &seq->cmds[seq->num_cmds - 1] : NULL;
+
+	/* a test key off immediately followed by the same key on cancel out */
+	if (last && !last->delay_ms && ak3b_is_test_key(cmd, len, 0x5A) &&
+	    ak3b_is_test_key(last->cmd, last->cmd_len, 0xA5) && last->cmd[0] == cmd[0]) {
+		seq->buf_len -= last->cmd_len;
+		seq->num_cmds--;
+		return 0;
+	}
+
+	if (seq->num_cmds >= AK3B_ENABLE_SEQ_CMDS_MAX ||
+	    seq->buf_len + len > AK3B_ENABLE_SEQ_BUF_SIZE)
+		return -ENOSPC;
+
+	if (len)
+		memcpy(&seq->buf[seq->buf_len], cmd, len);
+	seq->cmds[seq->num_cmds].cmd = len ? &seq->buf[seq->buf_len] : NULL;
+	seq->cmds[seq->num_cmds].cmd_len = len;
+	seq->cmds[seq->num_cmds].delay_ms = delay_ms;
+	seq->cmds[seq->num_cmds].panel_rev = PANEL_REV_ALL;
+	seq->buf_len += len;
+	seq->num_cmds++;
+
+	return 0;
+}
+
+static int ak3b_enable_seq_add_cmds(struct exynos_panel *ctx, struct ak3b_enable_seq *seq,
+				    const struct exynos_dsi_cmd *cmds, u32 num_cmd)
+{
+	int i, ret;
+
+	for (i = 0; i < num_cmd; i++) {
+		if (!(cmds[i].panel_rev & ctx->panel_rev))
+			continue;
+
+		ret = ak3b_enable_seq_add(seq, cmds[i].cmd, cmds[i].cmd_len, cmds[i].delay_ms);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * ak3b_enable_seq_compile() - compile the static part of the enable sequence
+ * @ctx: panel struct
+ *
+ * Resolve the init commands for the detected panel rev, then append the AOD,
+ * LHBM gamma and location settings and the DSC configuration. The test key
+ * brackets of consecutive settings are merged and the PPS is packed here once.
+ * The LHBM gamma is only included once calibrated, so this needs to be called
+ * again when the calibration completes. The caller must hold mode_lock.
+ */
+static void ak3b_enable_seq_compile(struct exynos_panel *ctx)
+{
+	struct ak3b_enable_seq *seq = &to_spanel(ctx)->enable_seq;
+	struct exynos_dsi_cmd gamma_cmds[LHBM_GAMMA_WRITE_CMDS_MAX];
+	int n, ret;
+
+	seq->ready = false;
+	seq->num_cmds = 0;
+	seq->buf_len = 0;
+
+	ret = ak3b_enable_seq_add_cmds(ctx, seq, ak3b_init_cmds, ARRAY_SIZE(ak3b_init_cmds));
+	ret = ret ? : ak3b_enable_seq_add_cmds(ctx, seq, ak3b_aod_without_blink_cmds,
+					       ARRAY_SIZE(ak3b_aod_without_blink_cmds));
+
+	n = to_spanel(ctx)->lhbm_cal_step == LHBM_CAL_IDLE ?
+		ak3b_lhbm_gamma_cmds(ctx, gamma_cmds) : 0;
+	if (n) {
+		ret = ret ? : ak3b_enable_seq_add(seq, test_key_on_f0, sizeof(test_key_on_f0), 0);
+		ret = ret ? : ak3b_enable_seq_add_cmds(ctx, seq, gamma_cmds, n);
+		ret = ret ? : ak3b_enable_seq_add(seq, test_key_off_f0, sizeof(test_key_off_f0), 0);
+	}
+
+	ret = ret ? : ak3b_enable_seq_add_cmds(ctx, seq, ak3b_lhbm_location_cmds,
+					       ARRAY_SIZE(ak3b_lhbm_location_cmds));
+
+	/* DSC related configuration */
+	ret = ret ? : ak3b_enable_seq_add(seq, NULL, 0, 0); /* DSC_DEC_ON, PPS_SETTING */
+	ret = ret ? : ak3b_enable_seq_add(seq, (const u8[]){ 0xC2, 0x14 }, 2, 0); /* PPS_MIC_OFF */
+	ret = ret ? : ak3b_enable_seq_add(seq, (const u8[]){ 0x9D, 0x01 }, 2, 0); /* PPS_DSC_EN */
+	if (ret) {
+		dev_err(ctx->dev, "%s: enable sequence doesn't fit (%d)\n", __func__, ret);
+		return;
+	}
+
+	drm_dsc_pps_payload_pack(&seq->pps_payload, &pps_config);
+	seq->ready = true;
+
+	dev_dbg(ctx->dev, "%s: %u cmds, %u bytes\n", __func__, seq->num_cmds, seq->buf_len);
+}
+
+/*
+ * Replay the compiled enable sequence. Commands are queued and only flushed
+ * before a delay, before the DSC configuration and at the end.
+ */
+static void ak3b_enable_seq_send(struct exynos_panel *ctx)
+{
+	struct mipi_dsi_device *dsi = to_mipi_dsi_device(ctx->dev);
+	const struct ak3b_enable_seq *seq = &to_spanel(ctx)->enable_seq;
+	const struct exynos_dsi_cmd *cmd;
+	bool flush;
+	int i;
+
+	DPU_ATRACE_BEGIN(__func__);
+	for (i = 0; i < seq->num_cmds; i++) {
+		cmd = &seq->cmds[i];
+
+		if (!cmd->cmd_len) {
+			exynos_dcs_compression_mode(ctx, 0x1); /* DSC_DEC_ON */
+			EXYNOS_PPS_WRITE_BUF(ctx, &seq->pps_payload); /* PPS_SETTING */
+			continue;
+		}
+
+		flush = cmd->delay_ms || i == seq->num_cmds - 1 || !seq->cmds[i + 1].cmd_len;
+		exynos_dsi_dcs_write_buffer(dsi, cmd->cmd, cmd->cmd_len,
+					    flush ? 0 : EXYNOS_DSI_MSG_QUEUE);
+		if (cmd->delay_ms)
+			usleep_range(cmd->delay_ms * 1000, cmd->delay_ms * 1000 + 10);
+	}
+	DPU_ATRACE_END(__func__);
+}
+
+/* wait for whatever remains of the sleep in sent by the last disable */
+static void ak3b_wait_sleep_in(struct exynos_panel *ctx)
+{
+	const s64 remaining_us = ktime_us_delta(to_spanel(ctx)->sleep_in_deadline, ktime_get());
+
+	if (remaining_us <= 0)
+		return;
+
+	DPU_ATRACE_BEGIN("ak3b_wait_sleep_in");
+	usleep_range(remaining_us, remaining_us + 100);
+	DPU_ATRACE_END("ak3b_wait_sleep_in");
+}
+
 static int ak3b_enable(struct drm_panel *panel)
 {
 	struct exynos_panel *ctx = container_of(panel, struct exynos_panel, panel);
@@ -764,6 +1866,7 @@ static int ak3b_enable(struct drm_panel *panel)
 	const struct drm_display_mode *mode;
 	struct drm_dsc_picture_parameter_set pps_payload;
 	struct ak3b_panel *spanel = to_spanel(ctx);
+	struct ak3_op_scope scope;
 
 	if (!pmode) {
 		dev_err(ctx->dev, "no current mode set\n");
@@ -772,44 +1875,191 @@ static int ak3b_enable(struct drm_panel *panel)
 	mode = &pmode->mode;
 
 	dev_dbg(ctx->dev, "%s+\n", __func__);
+	ak3b_op_begin(ctx, &scope, AK3B_OP_ENABLE);
 
+	ak3b_wait_sleep_in(ctx);
 	exynos_panel_reset(ctx);
+	/* registers are back to their defaults after reset */
+	ak3b_reg_shadow_invalidate(spanel);
+	/* the init sequence selects HS60 */
+	if (ctx->panel_rev >= PANEL_REV_PROTO1_1)
+		ak3b_reg_shadow_set(spanel, 0x60, 0, (const u8[]){ ak3b_rate_regs[HS60].sel, 0x00 }, 2);
+
+	if (spanel->enable_seq.ready) {
+		ak3b_enable_seq_send(ctx);
+		ak3b_change_frequency(ctx, drm_mode_vrefresh(mode));
+	} else {
+		/* the sequence is compiled once the panel rev is known */
+		exynos_panel_send_cmd_set(ctx, &ak3b_init_cmd_set);
+		exynos_panel_send_cmd_set(ctx, &ak3b_aod_without_blink_cmd_set);
+
+		ak3b_change_frequency(ctx, drm_mode_vrefresh(mode));
+
+		if (spanel->lhbm_cal_step == LHBM_CAL_IDLE)
+			ak3b_lhbm_gamma_write(ctx);
+		exynos_panel_send_cmd_set(ctx, &ak3b_lhbm_location_cmd_set);
+
+		/* DSC related configuration */
+		drm_dsc_pps_payload_pack(&pps_payload, &pps_config);
+		exynos_dcs_compression_mode(ctx, 0x1); /* DSC_DEC_ON */
+		EXYNOS_PPS_WRITE_BUF(ctx, &pps_payload); /* PPS_SETTING */
+		EXYNOS_DCS_BUF_ADD(ctx, 0xC2, 0x14); /* PPS_MIC_OFF */
+		EXYNOS_DCS_BUF_ADD_AND_FLUSH(ctx, 0x9D, 0x01); /* PPS_DSC_EN */
+	}
 
-	exynos_panel_send_cmd_set(ctx, &ak3b_init_cmd_set);
-	ak3b_send_aod_without_blink_settings(ctx);
-
-	ak3b_change_frequency(ctx, drm_mode_vrefresh(mode));
-
-	ak3b_lhbm_gamma_write(ctx);
-	exynos_panel_send_cmd_set(ctx, &ak3b_lhbm_location_cmd_set);
-
-	/* DSC related configuration */
-	drm_dsc_pps_payload_pack(&pps_payload, &pps_config);
-	exynos_dcs_compression_mode(ctx, 0x1); /* DSC_DEC_ON */
-	EXYNOS_PPS_WRITE_BUF(ctx, &pps_payload); /* PPS_SETTING */
-	EXYNOS_DCS_BUF_ADD(ctx, 0xC2, 0x14); /* PPS_MIC_OFF */
-	EXYNOS_DCS_BUF_ADD_AND_FLUSH(ctx, 0x9D, 0x01); /* PPS_DSC_EN */
+	/* pending calibration sends LHBM gamma when it completes */
+	if (spanel->lhbm_cal_step != LHBM_CAL_IDLE)
+		schedule_work(&spanel->lhbm_cal_work);
 
 	ak3b_update_wrctrld(ctx); /* dimming and HBM */
 
 	if (pmode->exynos_mode.is_lp_mode)
-		exynos_panel_set_lp_mode(ctx, pmode);
+		ak3b_set_lp_mode(ctx, pmode);
 
 	spanel->lhbm_ctl.hist_roi_configured = false;
 	spanel->needs_display_on = true;
 
+	ak3b_op_end(ctx, &scope);
 	dev_dbg(ctx->dev, "%s-\n", __func__);
 
 	return 0;
 }
 
+static void ak3b_write_irc(struct exynos_panel *ctx)
+{
+	EXYNOS_DCS_BUF_ADD(ctx, 0xF0, 0x5A, 0x5A); /* test_key_on */
+	EXYNOS_DCS_BUF_ADD(ctx, 0xB0, 0x00, 0x01, 0x6A); /* global para */
+	EXYNOS_DCS_BUF_ADD(ctx, 0x6A, IS_HBM_ON_IRC_OFF(ctx->hbm_mode) ? 0x01 : 0x21);
+	EXYNOS_DCS_BUF_ADD_AND_FLUSH(ctx, 0xF0, 0xA5, 0xA5); /* test_key_off */
+}
+
+static void ak3b_write_ssc(struct exynos_panel *ctx)
+{
+	ak3b_defer_cancel(ctx, AK3B_DEFER_SSC);
+	EXYNOS_DCS_BUF_ADD(ctx, 0xF0, 0x5A, 0x5A); /* test_key_on */
+	EXYNOS_DCS_BUF_ADD(ctx, 0xFC, 0x5A, 0x5A); /* test_key_on */
+	EXYNOS_DCS_BUF_ADD(ctx, 0xB0, 0x00, 0x6E, 0xC5); /* global para */
+	if (ctx->ssc_mode)
+		EXYNOS_DCS_BUF_ADD(ctx, 0xC5, 0x07, 0x7F);
+	else
+		EXYNOS_DCS_BUF_ADD(ctx, 0xC5, 0x04, 0x00);
+	EXYNOS_DCS_BUF_ADD(ctx, 0xFC, 0xA5, 0xA5); /* test_key_off */
+	EXYNOS_DCS_BUF_ADD_AND_FLUSH(ctx, 0xF0, 0xA5, 0xA5); /* test_key_off */
+}
+
+/* write the pending deferred writes, the caller must hold mode_lock */
+static void ak3b_deferred_flush(struct exynos_panel *ctx)
+{
+	struct ak3b_deferred *d = &to_spanel(ctx)->deferred;
+	const unsigned long pending = d->pending;
+
+	d->pending = 0;
+	if (!pending || !is_panel_active(ctx))
+		return;
+
+	DPU_ATRACE_BEGIN("ak3b_deferred_flush");
+	d->flushing = true;
+	if (pending & BIT(AK3B_DEFER_TE2))
+		ak3b_update_te2(ctx);
+	if (pending & BIT(AK3B_DEFER_SSC))
+		ak3b_write_ssc(ctx);
+	if (pending & BIT(AK3B_DEFER_WRCTRLD))
+		ak3b_update_wrctrld(ctx);
+	d->flushing = false;
+	d->batches++;
+	DPU_ATRACE_END("ak3b_deferred_flush");
+}
+
+/*
+ * Wait for the end of the TE pulse, the frame transfer is done and the
+ * deferred writes go out in the blanking period of vblank_usec. If the lock
+ * isn't taken before the window closes, try again at the next frame. The
+ * whole batch is timed from the TE edge, batches which don't end within the
+ * window are counted as overruns.
+ */
+static void ak3b_deferred_work(struct work_struct *work)
+{
+	struct ak3b_deferred *d = container_of(work, struct ak3b_deferred, work);
+	struct ak3b_panel *spanel = container_of(d, struct ak3b_panel, deferred);
+	struct exynos_panel *ctx = &spanel->base;
+	const struct exynos_panel_mode *pmode;
+	u32 te_us, period_us, vblank_us;
+	ktime_t window_start;
+	bool flushed;
+	int tries;
+
+	for (tries = 0; ; tries++) {
+		mutex_lock(&ctx->mode_lock);
+		pmode = ctx->current_mode;
+		if (!d->pending || !is_panel_active(ctx) || !pmode) {
+			mutex_unlock(&ctx->mode_lock);
+			return;
+		}
+		te_us = pmode->exynos_mode.te_usec;
+		vblank_us = pmode->exynos_mode.vblank_usec;
+		period_us = EXYNOS_VREFRESH_TO_PERIOD_USEC(drm_mode_vrefresh(&pmode->mode));
+		mutex_unlock(&ctx->mode_lock);
+
+		DPU_ATRACE_BEGIN("ak3b_deferred_wait_vsync");
+		exynos_panel_wait_for_vsync_done(ctx, te_us, period_us);
+		DPU_ATRACE_END("ak3b_deferred_wait_vsync");
+
+		window_start = ktime_get();
+		mutex_lock(&ctx->mode_lock);
+		if (ktime_us_delta(ktime_get(), window_start) <= vblank_us)
+			break;
+
+		d->missed++;
+		if (tries >= AK3B_DEFER_RETRIES)
+			break;
+		mutex_unlock(&ctx->mode_lock);
+	}
+
+	flushed = d->pending && is_panel_active(ctx);
+	ak3b_deferred_flush(ctx);
+	if (flushed && ktime_us_delta(ktime_get(), window_start) > vblank_us)
+		d->overrun++;
+	mutex_unlock(&ctx->mode_lock);
+}
+
 static int ak3b_disable(struct drm_panel *panel)
 {
 	struct exynos_panel *exynos_panel = container_of(panel, struct exynos_panel, panel);
 	struct ak3b_panel *spanel = to_spanel(exynos_panel);
+	int ret;
 
 	spanel->needs_display_on = false;
-	return exynos_panel_disable(panel);
+	ak3b_cancel_display_on(spanel);
+	/* producers first, they re-arm the idle and gray works */
+	cancel_work_sync(&spanel->udfps.work);
+	spanel->udfps.staged = false;
+	cancel_work_sync(&spanel->idle.boost_work);
+	ak3_brightness_cancel(&spanel->brt);
+	cancel_delayed_work_sync(&spanel->idle.work);
+	spanel->idle.freq = HS120;
+	cancel_delayed_work_sync(&spanel->udfps.gray_work);
+	spanel->udfps.gray_time = 0;
+
+	/* the state of the deferred writes is kept across disable */
+	cancel_work_sync(&spanel->deferred.work);
+	mutex_lock(&exynos_panel->mode_lock);
+	ak3b_deferred_flush(exynos_panel);
+	mutex_unlock(&exynos_panel->mode_lock);
+
+	ret = exynos_panel_disable(panel);
+	/* don't hold the caller for the sleep in, unprepare or enable wait for it */
+	spanel->sleep_in_deadline = ktime_add_ms(ktime_get(), AK3B_SLEEP_IN_MS);
+
+	return ret;
+}
+
+static int ak3b_unprepare(struct drm_panel *panel)
+{
+	struct exynos_panel *ctx = container_of(panel, struct exynos_panel, panel);
+
+	ak3b_wait_sleep_in(ctx);
+
+	return exynos_panel_unprepare(panel);
 }
 
 static void ak3b_set_hbm_mode(struct exynos_panel *exynos_panel,
@@ -820,21 +2070,171 @@ static void ak3b_set_hbm_mode(struct exynos_panel *exynos_panel,
 	const bool irc_update =
 		(IS_HBM_ON_IRC_OFF(exynos_panel->hbm_mode) != IS_HBM_ON_IRC_OFF(mode));
 
+	/* the brightness requested before the HBM change goes out first */
+	ak3_brightness_flush(&to_spanel(exynos_panel)->brt);
+
 	exynos_panel->hbm_mode = mode;
 
+	/* HBM and IRC go out with the HBM range DBV, they are never deferred */
 	if (hbm_update)
 		ak3b_update_wrctrld(exynos_panel);
 
-	if (irc_update) {
-		EXYNOS_DCS_BUF_ADD(exynos_panel, 0xF0, 0x5A, 0x5A); /* test_key_on */
-		EXYNOS_DCS_BUF_ADD(exynos_panel, 0xB0, 0x00, 0x01, 0x6A); /* global para */
-		EXYNOS_DCS_BUF_ADD(exynos_panel, 0x6A, IS_HBM_ON_IRC_OFF(mode) ? 0x01 : 0x21);
-		EXYNOS_DCS_BUF_ADD_AND_FLUSH(exynos_panel, 0xF0, 0xA5, 0xA5); /* test_key_off */
-	}
+	if (irc_update)
+		ak3b_write_irc(exynos_panel);
 	dev_info(exynos_panel->dev, "hbm_on=%d hbm_ircoff=%d\n", IS_HBM_ON(exynos_panel->hbm_mode),
 		 IS_HBM_ON_IRC_OFF(exynos_panel->hbm_mode));
 }
 
+static u32 ak3b_lhbm_luminance(struct exynos_panel *ctx, u32 dbv, u32 gray)
+{
+	u32 normal_dbv_max = ctx->desc->brt_capability->normal.level.max;
+	u32 normal_nit_max = ctx->desc->brt_capability->normal.nits.max;
+	u32 luma;
+
+	if (dbv <= normal_dbv_max)
+		luma = panel_cmn_calc_gamma_2_2_luminance(dbv, normal_dbv_max,
+		normal_nit_max);
+	else
+		luma = panel_cmn_calc_linear_luminance(dbv, 645, -1256);
+
+	return panel_cmn_calc_gamma_2_2_luminance(gray, 255, luma);
+}
+
+/*
+ * The luminance grows with DBV within each brightness segment, so the overdrive
+ * group for a gray level is given by the lowest DBV reaching each threshold.
+ */
+static void ak3b_lhbm_od_lut_init(struct exynos_panel *ctx)
+{
+	struct ak3b_lhbm_ctl *ctl = &to_spanel(ctx)->lhbm_ctl;
+	const struct brightness_capability *brt_cap = ctx->desc->brt_capability;
+	const u32 seg_min[LHBM_OD_SEG_MAX] = { 0, brt_cap->normal.level.max + 1 };
+	const u32 seg_max[LHBM_OD_SEG_MAX] = {
+		brt_cap->normal.level.max, brt_cap->hbm.level.max
+	};
+	u32 gray, seg, i, lo, hi, mid;
+
+	if (ctl->od_lut_ready)
+		return;
+
+	DPU_ATRACE_BEGIN(__func__);
+	for (gray = LHBM_OD_GRAY_MIN; gray < LHBM_OD_GRAY_COUNT; gray++) {
+		for (seg = 0; seg < LHBM_OD_SEG_MAX; seg++) {
+			for (i = 0; i < LHBM_OD_THRESHOLD_COUNT; i++) {
+				/* search in [lo, hi], hi means never reached */
+				lo = seg_min[seg];
+				hi = seg_max[seg] + 1;
+				while (lo < hi) {
+					mid = lo + (hi - lo) / 2;
+					if (ak3b_lhbm_luminance(ctx, mid, gray) >=
+					    lhbm_od_threshold_nits[i])
+						hi = mid;
+					else
+						lo = mid + 1;
+				}
+				ctl->od_dbv[gray][seg][i] = lo;
+			}
+		}
+	}
+	/* built at probe, pairs with ak3b_set_local_hbm_brightness() */
+	smp_store_release(&ctl->od_lut_ready, true);
+	DPU_ATRACE_END(__func__);
+}
+
+static enum ak3b_lhbm_brt_overdrive_group ak3b_lhbm_od_group(struct exynos_panel *ctx,
+							     u32 dbv, u32 gray)
+{
+	const struct ak3b_lhbm_ctl *ctl = &to_spanel(ctx)->lhbm_ctl;
+	const u16 *od_dbv;
+	int group = LHBM_OVERDRIVE_GRP_6_NIT;
+	int i;
+
+	if (gray < LHBM_OD_GRAY_MIN)
+		return LHBM_OVERDRIVE_GRP_0_NIT;
+
+	gray = min_t(u32, gray, LHBM_OD_GRAY_COUNT - 1);
+	od_dbv = ctl->od_dbv[gray][dbv > ctx->desc->brt_capability->normal.level.max ?
+				   LHBM_OD_SEG_HBM : LHBM_OD_SEG_NORMAL];
+	for (i = 0; i < LHBM_OD_THRESHOLD_COUNT; i++)
+		group += dbv >= od_dbv[i];
+
+	return group;
+}
+
+/* overdrive group computed from the luminance, as before the lookup table */
+static enum ak3b_lhbm_brt_overdrive_group ak3b_lhbm_od_group_ref(struct exynos_panel *ctx,
+								 u32 dbv, u32 gray)
+{
+	u32 luma;
+	int i;
+
+	if (gray < LHBM_OD_GRAY_MIN)
+		return LHBM_OVERDRIVE_GRP_0_NIT;
+
+	luma = ak3b_lhbm_luminance(ctx, dbv, gray);
+	for (i = 0; i < LHBM_OD_THRESHOLD_COUNT; i++) {
+		if (luma < lhbm_od_threshold_nits[i])
+			break;
+	}
+
+	return LHBM_OVERDRIVE_GRP_6_NIT + i;
+}
+
+#define LHBM_OD_CHECK_REPORT_MAX 16
+
+/*
+ * Compare the lookup table with the luminance thresholds for every DBV and gray
+ * level. The table relies on the luminance growing with DBV within a segment,
+ * this catches a brightness capability or luminance curve breaking that.
+ */
+static int ak3b_lhbm_od_check_show(struct seq_file *m, void *data)
+{
+	struct exynos_panel *ctx = m->private;
+	const u32 dbv_max = ctx->desc->brt_capability->hbm.level.max;
+	u32 dbv, gray, checked = 0, mismatches = 0;
+	int group, ref;
+
+	if (!smp_load_acquire(&to_spanel(ctx)->lhbm_ctl.od_lut_ready)) {
+		seq_puts(m, "lookup table not built\n");
+		return 0;
+	}
+
+	for (dbv = 0; dbv <= dbv_max; dbv++) {
+		for (gray = 0; gray < LHBM_OD_GRAY_COUNT; gray++) {
+			group = ak3b_lhbm_od_group(ctx, dbv, gray);
+			ref = ak3b_lhbm_od_group_ref(ctx, dbv, gray);
+			checked++;
+			if (group == ref)
+				continue;
+			if (mismatches++ < LHBM_OD_CHECK_REPORT_MAX)
+				seq_printf(m, "dbv=%u gray=%u group=%d expected=%d\n",
+					   dbv, gray, group, ref);
+		}
+		cond_resched();
+	}
+	seq_printf(m, "checked=%u mismatches=%u\n", checked, mismatches);
+
+	return 0;
+}
+
+DEFINE_SHOW_ATTRIBUTE(ak3b_lhbm_od_check);
+
+static void ak3b_lhbm_brightness_write(struct exynos_panel *ctx, enum frequency freq,
+				       const u8 *brt)
+{
+	/* command uses one byte besides brightness */
+	static u8 cmd[LHBM_BRT_LEN + 1];
+	int i;
+
+	cmd[0] = lhbm_brightness_write_reg;
+	for (i = 0; i < LHBM_BRT_LEN; i++)
+		cmd[i+1] = brt[i];
+	EXYNOS_DCS_BUF_ADD_SET(ctx, test_key_on_f0);
+	EXYNOS_DCS_BUF_ADD_SET(ctx, lhbm_brightness_write_index[freq]);
+	EXYNOS_DCS_BUF_ADD_SET(ctx, cmd);
+	EXYNOS_DCS_BUF_ADD_SET_AND_FLUSH(ctx, test_key_off_f0);
+}
+
 static void ak3b_set_local_hbm_brightness(struct exynos_panel *ctx, bool is_first_stage)
 {
 	struct ak3b_panel *spanel = to_spanel(ctx);
@@ -842,9 +2242,6 @@ static void ak3b_set_local_hbm_brightness(struct exynos_panel *ctx, bool is_firs
 	const u8 *brt;
 	enum ak3b_lhbm_brt_overdrive_group group = LHBM_OVERDRIVE_GRP_MAX;
 	enum frequency freq = ak3b_get_frequency(ctx);
-	/* command uses one byte besides brightness */
-	static u8 cmd[LHBM_BRT_LEN + 1];
-	int i;
 
 	if (!is_local_hbm_post_enabling_supported(ctx))
 		return;
@@ -853,33 +2250,13 @@ static void ak3b_set_local_hbm_brightness(struct exynos_panel *ctx, bool is_firs
 
 	dev_info(ctx->dev, "set LHBM brightness at %s stage\n", is_first_stage ? "1st" : "2nd");
 	if (is_first_stage) {
-		u32 gray = exynos_drm_connector_get_lhbm_gray_level(&ctx->exynos_connector);
+		u32 gray = ak3b_lhbm_gray_level(ctx);
 		u32 dbv = exynos_panel_get_brightness(ctx);
-		u32 normal_dbv_max = ctx->desc->brt_capability->normal.level.max;
-		u32 normal_nit_max = ctx->desc->brt_capability->normal.nits.max;
-		u32 luma = 0;
 
-		if (gray < 15) {
-			group = LHBM_OVERDRIVE_GRP_0_NIT;
-		} else {
-			if (dbv <= normal_dbv_max)
-				luma = panel_cmn_calc_gamma_2_2_luminance(dbv, normal_dbv_max,
-				normal_nit_max);
-			else
-				luma = panel_cmn_calc_linear_luminance(dbv, 645, -1256);
-			luma = panel_cmn_calc_gamma_2_2_luminance(gray, 255, luma);
-
-			if (luma < 6)
-				group = LHBM_OVERDRIVE_GRP_6_NIT;
-			else if (luma < 50)
-				group = LHBM_OVERDRIVE_GRP_50_NIT;
-			else if (luma < 300)
-				group = LHBM_OVERDRIVE_GRP_300_NIT;
-			else
-				group = LHBM_OVERDRIVE_GRP_MAX;
-		}
-		dev_info(ctx->dev, "check LHBM overdrive condition | gray=%u dbv=%u luma=%u\n",
-			gray, dbv, luma);
+		if (likely(smp_load_acquire(&ctl->od_lut_ready)))
+			group = ak3b_lhbm_od_group(ctx, dbv, gray);
+		dev_info(ctx->dev, "check LHBM overdrive condition | gray=%u dbv=%u group=%d\n",
+			gray, dbv, group);
 	}
 
 	if (group < LHBM_OVERDRIVE_GRP_MAX) {
@@ -889,16 +2266,10 @@ static void ak3b_set_local_hbm_brightness(struct exynos_panel *ctx, bool is_firs
 		brt = ctl->brt_normal[freq];
 		ctl->overdrived = false;
 	}
-	cmd[0] = lhbm_brightness_write_reg;
-	for (i = 0; i < LHBM_BRT_LEN; i++)
-		cmd[i+1] = brt[i];
 	dev_info(ctx->dev, "set %s brightness: [%d] %*ph\n",
 		ctl->overdrived ? "overdrive" : "normal",
 		ctl->overdrived ? group : -1, LHBM_BRT_LEN, brt);
-	EXYNOS_DCS_BUF_ADD_SET(ctx, test_key_on_f0);
-	EXYNOS_DCS_BUF_ADD_SET(ctx, lhbm_brightness_write_index[freq]);
-	EXYNOS_DCS_BUF_ADD_SET(ctx, cmd);
-	EXYNOS_DCS_BUF_ADD_SET_AND_FLUSH(ctx, test_key_off_f0);
+	ak3b_lhbm_brightness_write(ctx, freq, brt);
 
 	DPU_ATRACE_END(__func__);
 }
@@ -906,15 +2277,31 @@ static void ak3b_set_local_hbm_brightness(struct exynos_panel *ctx, bool is_firs
 static void ak3b_set_local_hbm_mode_post(struct exynos_panel *ctx)
 {
 	const struct ak3b_panel *spanel = to_spanel(ctx);
+	struct ak3_op_scope scope;
+
+	ak3b_op_begin(ctx, &scope, AK3B_OP_LHBM);
 
 	if (spanel->lhbm_ctl.overdrived)
 		ak3b_set_local_hbm_brightness(ctx, false);
 
-	/* b/291544944 Extra 1 frame delay for NS mode */
+	/*
+	 * b/291544944 Extra 1 frame delay for NS mode. Waiting for the next vsync
+	 * rather than a full frame period, the vblank wait falls back to sleeping
+	 * one period if vblank isn't available and is bounded by its own timeout.
+	 */
 	if (ak3b_get_frequency(ctx) == NS60) {
-		usleep_range(16700, 16710);
-		dev_info(ctx->dev, "wait 1 frame for NS mode\n");
+		const struct exynos_panel_mode *pmode = ctx->current_mode;
+		u32 vrefresh = pmode ? drm_mode_vrefresh(&pmode->mode) : 60;
+		u32 te_usec = pmode ? pmode->exynos_mode.te_usec : 0;
+
+		DPU_ATRACE_BEGIN("ak3b_lhbm_wait_ns_vsync");
+		exynos_panel_wait_for_vsync_done(ctx, te_usec,
+			EXYNOS_VREFRESH_TO_PERIOD_USEC(vrefresh));
+		DPU_ATRACE_END("ak3b_lhbm_wait_ns_vsync");
+		dev_info(ctx->dev, "wait 1 vsync for NS mode\n");
 	}
+
+	ak3b_op_end(ctx, &scope);
 }
 
 static void ak3b_set_dimming_on(struct exynos_panel *exynos_panel,
@@ -928,16 +2315,129 @@ static void ak3b_set_dimming_on(struct exynos_panel *exynos_panel,
 		return;
 	}
 
-	ak3b_update_wrctrld(exynos_panel);
+	if (!ak3b_defer(exynos_panel, AK3B_DEFER_WRCTRLD))
+		ak3b_update_wrctrld(exynos_panel);
+}
+
+/*
+ * Put back the normal LHBM brightness if LHBM wasn't enabled since it was
+ * pre-staged, the caller must hold mode_lock. A staged overdrive left in the
+ * panel would otherwise only be replaced at the next LHBM enable.
+ */
+static void ak3b_udfps_unstage(struct exynos_panel *ctx)
+{
+	struct ak3b_panel *spanel = to_spanel(ctx);
+	struct ak3b_udfps *udfps = &spanel->udfps;
+	struct ak3b_lhbm_ctl *ctl = &spanel->lhbm_ctl;
+	struct ak3_op_scope scope;
+
+	if (!udfps->staged || ctx->hbm.local_hbm.enabled)
+		return;
+
+	udfps->staged = false;
+	if (!ctl->overdrived || !is_panel_active(ctx))
+		return;
+
+	ak3b_op_begin(ctx, &scope, AK3B_OP_LHBM);
+	dev_dbg(ctx->dev, "restore the normal LHBM brightness of %s\n",
+		frequency_str[udfps->staged_freq]);
+	ak3b_lhbm_brightness_write(ctx, udfps->staged_freq, ctl->brt_normal[udfps->staged_freq]);
+	ctl->overdrived = false;
+	ak3b_op_end(ctx, &scope);
+}
+
+/*
+ * Write the LHBM brightness ahead of the LHBM enable on a touch-down over the
+ * fingerprint sensor. The brightness only takes effect once WRCTRLD turns LHBM on,
+ * so nothing is visible until userspace confirms with set_local_hbm_mode. If the
+ * finger lifts or UDFPS is disarmed first, the normal brightness is put back.
+ */
+static void ak3b_udfps_work(struct work_struct *work)
+{
+	struct ak3b_udfps *udfps = container_of(work, struct ak3b_udfps, work);
+	struct ak3b_panel *spanel = container_of(udfps, struct ak3b_panel, udfps);
+	struct exynos_panel *ctx = &spanel->base;
+	struct ak3_op_scope scope;
+	unsigned long flags;
+	ktime_t down_time;
+	bool touching;
+
+	spin_lock_irqsave(&udfps->lock, flags);
+	down_time = udfps->down_time;
+	touching = udfps->touch_slot >= 0;
+	spin_unlock_irqrestore(&udfps->lock, flags);
+
+	mutex_lock(&ctx->mode_lock);
+	if (!touching || !READ_ONCE(udfps->armed)) {
+		ak3b_udfps_unstage(ctx);
+		goto out;
+	}
+
+	/* the touch-down is too old for LHBM to follow, e.g. after a long mode switch */
+	if (ktime_ms_delta(ktime_get(), down_time) > AK3B_UDFPS_STAGE_MS)
+		goto out;
+
+	if (!is_panel_active(ctx) || !ctx->current_mode ||
+	    ctx->current_mode->exynos_mode.is_lp_mode || ctx->hbm.local_hbm.enabled)
+		goto out;
+
+	DPU_ATRACE_BEGIN(__func__);
+	ak3b_op_begin(ctx, &scope, AK3B_OP_LHBM);
+	if (spanel->lhbm_cal_step != LHBM_CAL_IDLE)
+		ak3b_lhbm_cal_finish(ctx);
+	/* LHBM gamma is calibrated for the mode frequency, leave the idle frequency */
+	ak3b_idle_kick(ctx);
+	ak3b_set_local_hbm_brightness(ctx, true);
+	ak3b_op_end(ctx, &scope);
+	DPU_ATRACE_END(__func__);
+
+	udfps->staged = true;
+	udfps->staged_time = ktime_get();
+	udfps->staged_freq = ak3b_get_frequency(ctx);
+	udfps->staged_dbv = exynos_panel_get_brightness(ctx);
+	udfps->stages++;
+out:
+	mutex_unlock(&ctx->mode_lock);
+}
+
+/* whether the staged LHBM brightness still matches, the caller must hold mode_lock */
+static bool ak3b_udfps_use_staged(struct exynos_panel *ctx)
+{
+	struct ak3b_udfps *udfps = &to_spanel(ctx)->udfps;
+
+	if (!udfps->staged || udfps->staged_freq != ak3b_get_frequency(ctx) ||
+	    udfps->staged_dbv != exynos_panel_get_brightness(ctx) ||
+	    ktime_ms_delta(ktime_get(), udfps->staged_time) > AK3B_UDFPS_STAGE_MS)
+		return false;
+
+	udfps->hits++;
+	dev_dbg(ctx->dev, "use pre-staged LHBM brightness\n");
+
+	return true;
 }
 
 static void ak3b_set_local_hbm_mode(struct exynos_panel *exynos_panel,
 				 bool local_hbm_en)
 {
+	struct ak3_op_scope scope;
+
+	/* the request came before the deferred calibration completed */
+	if (local_hbm_en && to_spanel(exynos_panel)->lhbm_cal_step != LHBM_CAL_IDLE)
+		ak3b_lhbm_cal_finish(exynos_panel);
+
+	/* LHBM gamma is calibrated for the mode frequency, leave the idle frequency */
+	if (local_hbm_en && to_spanel(exynos_panel)->idle.freq != HS120)
+		ak3b_idle_set_frequency(exynos_panel, HS120);
+	else if (!local_hbm_en)
+		ak3b_idle_kick(exynos_panel);
+
+	ak3b_op_begin(exynos_panel, &scope, AK3B_OP_LHBM);
 	ak3b_update_wrctrld(exynos_panel);
 
-	if (local_hbm_en)
+	if (local_hbm_en && !ak3b_udfps_use_staged(exynos_panel))
 		ak3b_set_local_hbm_brightness(exynos_panel, true);
+	to_spanel(exynos_panel)->udfps.staged = false;
+	ak3b_op_end(exynos_panel, &scope);
 }
 
 static void ak3b_mode_set(struct exynos_panel *ctx,
@@ -993,66 +2493,499 @@ static void ak3b_calculate_lhbm_brightness(struct exynos_panel *ctx,
 		rgb_ratio[0], rgb_ratio[1], rgb_ratio[2]);
 }
 
-static void ak3b_lhbm_brightness_init(struct exynos_panel *ctx)
+static void ak3b_lhbm_overdrive_init(struct exynos_panel *ctx, int freq)
 {
-	struct mipi_dsi_device *dsi = to_mipi_dsi_device(ctx->dev);
 	struct ak3b_panel *spanel = to_spanel(ctx);
 	struct ak3b_lhbm_ctl *ctl = &spanel->lhbm_ctl;
-	int group, freq, ret;
+	int group;
+
+	for (group = 0; group < LHBM_OVERDRIVE_GRP_MAX; group++) {
+		ak3b_calculate_lhbm_brightness(ctx, ctl->brt_normal[freq],
+			lhbm_rgb_ratio[group], ctl->brt_overdrive[freq][group]);
+	}
+}
+
+static const struct ak3_reg_read lhbm_brightness_reads[FREQUENCY_COUNT] = {
+	{ 0x22, 0xD8, LHBM_BRT_LEN }, /* HS120 */
+	{ 0x18, 0xD8, LHBM_BRT_LEN }, /* HS60 */
+	{ 0x1D, 0xD8, LHBM_BRT_LEN }, /* NS60 */
+};
+
+static int ak3b_lhbm_brightness_init(struct exynos_panel *ctx)
+{
+	struct ak3b_panel *spanel = to_spanel(ctx);
+	struct ak3b_lhbm_ctl *ctl = &spanel->lhbm_ctl;
+	u32 failed;
+	int freq, err;
+
+	err = ak3_read_regs(ctx, lhbm_brightness_reads, FREQUENCY_COUNT,
+			     &ctl->brt_normal[0][0], &failed);
 
 	for (freq = 0; freq < FREQUENCY_COUNT; freq++) {
-		EXYNOS_DCS_WRITE_TABLE(ctx, test_key_on_f0);
-		EXYNOS_DCS_WRITE_TABLE(ctx, lhbm_brightness_read_index[freq]);
-		ret = mipi_dsi_dcs_read(dsi, lhbm_brightness_read_reg,
-			ctl->brt_normal[freq], LHBM_BRT_LEN);
-		EXYNOS_DCS_WRITE_TABLE(ctx, test_key_off_f0);
-
-		if (ret != LHBM_BRT_LEN) {
-			dev_err(ctx->dev, "failed to read lhbm para for %s ret=%d\n",
-				frequency_str[freq], ret);
+		if (failed & BIT(freq)) {
+			dev_err(ctx->dev, "failed to read lhbm para for %s\n",
+				frequency_str[freq]);
 			continue;
 		}
 
 		dev_info(ctx->dev, "lhbm normal brightness for %s: %*ph\n",
 			frequency_str[freq], LHBM_BRT_LEN, ctl->brt_normal[freq]);
 
-		for (group = 0; group < LHBM_OVERDRIVE_GRP_MAX; group++) {
-			ak3b_calculate_lhbm_brightness(ctx, ctl->brt_normal[freq],
-				lhbm_rgb_ratio[group], ctl->brt_overdrive[freq][group]);
-		}
+		ak3b_lhbm_overdrive_init(ctx, freq);
 	}
 
 	print_hex_dump_debug("ak3b-od-brightness: ", DUMP_PREFIX_NONE,
 		16, 1,
 		ctl->brt_overdrive, sizeof(ctl->brt_overdrive), false);
+
+	return err;
 }
 
+/* run one LHBM calibration step, the caller must hold mode_lock */
+static void ak3b_lhbm_cal_run_step(struct exynos_panel *ctx)
+{
+	struct ak3b_panel *spanel = to_spanel(ctx);
+
+	dev_dbg(ctx->dev, "%s: step %d\n", __func__, spanel->lhbm_cal_step);
+
+	switch (spanel->lhbm_cal_step) {
+	case LHBM_CAL_BRIGHTNESS:
+		ak3b_lhbm_brightness_init(ctx);
+		spanel->lhbm_cal_step = LHBM_CAL_GAMMA;
+		break;
+	case LHBM_CAL_GAMMA:
+		ak3b_lhbm_gamma_read(ctx);
+		spanel->lhbm_cal_step = LHBM_CAL_APPLY;
+		break;
+	case LHBM_CAL_APPLY:
+		exynos_panel_send_cmd_set(ctx, &ak3b_lhbm_location_cmd_set);
+		ak3b_lhbm_gamma_write(ctx);
+		exynos_panel_send_cmd_set(ctx, &ak3b_aod_without_blink_cmd_set);
+		spanel->lhbm_cal_step = LHBM_CAL_IDLE;
+		/* pick up the LHBM gamma in the enable sequence */
+		ak3b_enable_seq_compile(ctx);
+		dev_info(ctx->dev, "lhbm calibration done\n");
+		break;
+	default:
+		break;
+	}
+}
+
+/* complete the pending LHBM calibration synchronously, with mode_lock held */
+static void ak3b_lhbm_cal_finish(struct exynos_panel *ctx)
+{
+	struct ak3b_panel *spanel = to_spanel(ctx);
+
+	DPU_ATRACE_BEGIN(__func__);
+	while (spanel->lhbm_cal_step != LHBM_CAL_IDLE)
+		ak3b_lhbm_cal_run_step(ctx);
+	DPU_ATRACE_END(__func__);
+}
+
+/*
+ * The calibration is split in steps, and mode_lock is dropped in between so that
+ * commits and other panel operations are not held off by the OTP reads. It pauses
+ * while the panel is off and is resumed by the next enable.
+ */
+static void ak3b_lhbm_cal_work(struct work_struct *work)
+{
+	struct ak3b_panel *spanel = container_of(work, struct ak3b_panel, lhbm_cal_work);
+	struct exynos_panel *ctx = &spanel->base;
+	bool done;
+
+	do {
+		mutex_lock(&ctx->mode_lock);
+		if (is_panel_active(ctx) && spanel->lhbm_cal_step != LHBM_CAL_IDLE)
+			ak3b_lhbm_cal_run_step(ctx);
+		done = !is_panel_active(ctx) || spanel->lhbm_cal_step == LHBM_CAL_IDLE;
+		mutex_unlock(&ctx->mode_lock);
+	} while (!done);
+}
+
+static int ak3b_op_stats_show(struct seq_file *m, void *data)
+{
+	struct exynos_panel *ctx = m->private;
+	struct ak3b_panel *spanel = to_spanel(ctx);
+	struct ak3b_deferred deferred;
+
+	ak3_op_stats_show(m, &spanel->op_stats);
+
+	mutex_lock(&ctx->mode_lock);
+	deferred = spanel->deferred;
+	mutex_unlock(&ctx->mode_lock);
+	seq_printf(m, "deferred %llu merged %llu batches %llu missed %llu overrun %llu\n",
+		   deferred.deferred, deferred.merged, deferred.batches, deferred.missed,
+		   deferred.overrun);
+
+	return 0;
+}
+static int ak3b_op_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, ak3b_op_stats_show, inode->i_private);
+}
+
+/* any write resets the statistics */
+static ssize_t ak3b_op_stats_write(struct file *file, const char __user *user_buf,
+				   size_t count, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct exynos_panel *ctx = m->private;
+	struct ak3b_panel *spanel = to_spanel(ctx);
+
+	ak3_op_stats_reset(&spanel->op_stats);
+
+	mutex_lock(&ctx->mode_lock);
+	spanel->deferred.deferred = 0;
+	spanel->deferred.merged = 0;
+	spanel->deferred.batches = 0;
+	spanel->deferred.missed = 0;
+	spanel->deferred.overrun = 0;
+	mutex_unlock(&ctx->mode_lock);
+
+	return count;
+}
+
+static const struct file_operations ak3b_op_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = ak3b_op_stats_open,
+	.read = seq_read,
+	.write = ak3b_op_stats_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
 static void ak3b_panel_init(struct exynos_panel *ctx)
 {
 	struct dentry *csroot = ctx->debugfs_cmdset_entry;
+	struct ak3b_panel *spanel = to_spanel(ctx);
 
 	exynos_panel_debugfs_create_cmdset(ctx, csroot,
 					   &ak3b_init_cmd_set, "init");
+	debugfs_create_file("op_stats", 0600, ctx->debugfs_entry, ctx, &ak3b_op_stats_fops);
+	debugfs_create_file("lhbm_od_check", 0400, ctx->debugfs_entry, ctx,
+			    &ak3b_lhbm_od_check_fops);
+	ak3b_enable_seq_compile(ctx);
+
+	/* LHBM overdrive init, deferred so that it doesn't hold off the first frame */
+	spanel->lhbm_cal_step = LHBM_CAL_BRIGHTNESS;
+	schedule_work(&spanel->lhbm_cal_work);
+}
+
+static ssize_t brightness_coalesce_show(struct device *dev,
+					struct device_attribute *attr, char *buf)
+{
+	struct mipi_dsi_device *dsi = to_mipi_dsi_device(dev);
+	struct exynos_panel *ctx = mipi_dsi_get_drvdata(dsi);
+
+	return sysfs_emit(buf, "%d\n", to_spanel(ctx)->brt.coalesce);
+}
+
+static ssize_t brightness_coalesce_store(struct device *dev, struct device_attribute *attr,
+					 const char *buf, size_t count)
+{
+	struct mipi_dsi_device *dsi = to_mipi_dsi_device(dev);
+	struct exynos_panel *ctx = mipi_dsi_get_drvdata(dsi);
+	struct ak3b_panel *spanel = to_spanel(ctx);
+	bool enable;
+	int ret;
+
+	ret = kstrtobool(buf, &enable);
+	if (ret)
+		return ret;
+
+	mutex_lock(&ctx->mode_lock);
+	spanel->brt.coalesce = enable;
+	if (!enable && is_panel_active(ctx))
+		ak3_brightness_flush(&spanel->brt);
+	mutex_unlock(&ctx->mode_lock);
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(brightness_coalesce);
+
+static ssize_t brightness_ramp_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct mipi_dsi_device *dsi = to_mipi_dsi_device(dev);
+	struct exynos_panel *ctx = mipi_dsi_get_drvdata(dsi);
+	const struct ak3_brightness_ramp *ramp = &to_spanel(ctx)->brt.ramp;
+	ssize_t ret;
+
+	mutex_lock(&ctx->mode_lock);
+	if (ramp->active)
+		ret = sysfs_emit(buf, "%u -> %u step %u/%u every %ums%s\n", ramp->start,
+				 ramp->target, ramp->step, ramp->num_steps, ramp->interval_ms,
+				 ramp->hw_dimming ? " hw dimming" : "");
+	else
+		ret = sysfs_emit(buf, "idle\n");
+	mutex_unlock(&ctx->mode_lock);
+
+	return ret;
+}
+
+/* "<target dbv> <duration ms>" starts a ramp */
+static ssize_t brightness_ramp_store(struct device *dev, struct device_attribute *attr,
+				     const char *buf, size_t count)
+{
+	struct mipi_dsi_device *dsi = to_mipi_dsi_device(dev);
+	struct exynos_panel *ctx = mipi_dsi_get_drvdata(dsi);
+	u32 target, duration_ms;
+	int ret;
+
+	if (sscanf(buf, "%u %u", &target, &duration_ms) != 2)
+		return -EINVAL;
+
+	mutex_lock(&ctx->mode_lock);
+	ret = ak3_ramp_start(&to_spanel(ctx)->brt, target, duration_ms);
+	mutex_unlock(&ctx->mode_lock);
+
+	return ret ? : count;
+}
+
+static DEVICE_ATTR_RW(brightness_ramp);
+
+static ssize_t ak3b_idle_frames_show(struct device *dev, char *buf, const u32 *frames)
+{
+	return sysfs_emit(buf, "%u\n", READ_ONCE(*frames));
+}
+
+static ssize_t ak3b_idle_frames_store(struct device *dev, const char *buf, size_t count,
+				      u32 *frames)
+{
+	struct mipi_dsi_device *dsi = to_mipi_dsi_device(dev);
+	struct exynos_panel *ctx = mipi_dsi_get_drvdata(dsi);
+	u32 val;
+	int ret;
+
+	ret = kstrtou32(buf, 0, &val);
+	if (ret)
+		return ret;
+
+	mutex_lock(&ctx->mode_lock);
+	*frames = val;
+	ak3b_idle_kick(ctx);
+	mutex_unlock(&ctx->mode_lock);
 
-	/* LHBM overdrive init */
-	ak3b_lhbm_brightness_init(ctx);
-	exynos_panel_send_cmd_set(ctx, &ak3b_lhbm_location_cmd_set);
-	ak3b_lhbm_gamma_read(ctx);
-	ak3b_lhbm_gamma_write(ctx);
-	ak3b_send_aod_without_blink_settings(ctx);
+	return count;
+}
+
+static ssize_t idle_hs60_frames_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct exynos_panel *ctx = mipi_dsi_get_drvdata(to_mipi_dsi_device(dev));
+
+	return ak3b_idle_frames_show(dev, buf, &to_spanel(ctx)->idle.hs60_frames);
+}
+
+static ssize_t idle_hs60_frames_store(struct device *dev, struct device_attribute *attr,
+				      const char *buf, size_t count)
+{
+	struct exynos_panel *ctx = mipi_dsi_get_drvdata(to_mipi_dsi_device(dev));
+
+	return ak3b_idle_frames_store(dev, buf, count, &to_spanel(ctx)->idle.hs60_frames);
+}
+
+static DEVICE_ATTR_RW(idle_hs60_frames);
+
+static ssize_t idle_ns60_frames_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct exynos_panel *ctx = mipi_dsi_get_drvdata(to_mipi_dsi_device(dev));
+
+	return ak3b_idle_frames_show(dev, buf, &to_spanel(ctx)->idle.ns60_frames);
+}
+
+static ssize_t idle_ns60_frames_store(struct device *dev, struct device_attribute *attr,
+				      const char *buf, size_t count)
+{
+	struct exynos_panel *ctx = mipi_dsi_get_drvdata(to_mipi_dsi_device(dev));
+
+	return ak3b_idle_frames_store(dev, buf, count, &to_spanel(ctx)->idle.ns60_frames);
+}
+
+static DEVICE_ATTR_RW(idle_ns60_frames);
+
+static ssize_t udfps_prestage_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct exynos_panel *ctx = mipi_dsi_get_drvdata(to_mipi_dsi_device(dev));
+	struct ak3b_udfps *udfps = &to_spanel(ctx)->udfps;
+	ssize_t len;
+
+	mutex_lock(&ctx->mode_lock);
+	len = sysfs_emit(buf, "%d stages=%llu hits=%llu gray_hits=%llu gray_misses=%llu\n",
+			 udfps->armed, udfps->stages, udfps->hits, udfps->gray_hits,
+			 udfps->gray_misses);
+	mutex_unlock(&ctx->mode_lock);
+
+	return len;
+}
+
+static ssize_t udfps_prestage_store(struct device *dev, struct device_attribute *attr,
+				    const char *buf, size_t count)
+{
+	struct exynos_panel *ctx = mipi_dsi_get_drvdata(to_mipi_dsi_device(dev));
+	struct ak3b_udfps *udfps = &to_spanel(ctx)->udfps;
+	bool armed;
+	int ret;
+
+	ret = kstrtobool(buf, &armed);
+	if (ret)
+		return ret;
+
+	if (armed && !udfps->has_location)
+		return -ENODEV;
+
+	mutex_lock(&ctx->mode_lock);
+	WRITE_ONCE(udfps->armed, armed);
+	ak3b_udfps_gray_kick(ctx);
+	mutex_unlock(&ctx->mode_lock);
+
+	/* stop sampling right away, the work takes mode_lock */
+	if (!armed) {
+		cancel_delayed_work_sync(&udfps->gray_work);
+		mutex_lock(&ctx->mode_lock);
+		ak3b_udfps_unstage(ctx);
+		udfps->gray_time = 0;
+		/* armed again meanwhile */
+		ak3b_udfps_gray_kick(ctx);
+		mutex_unlock(&ctx->mode_lock);
+	}
+
+	return count;
+}
+
+static DEVICE_ATTR_RW(udfps_prestage);
+
+static struct attribute *ak3b_attrs[] = {
+	&dev_attr_brightness_coalesce.attr,
+	&dev_attr_brightness_ramp.attr,
+	&dev_attr_idle_hs60_frames.attr,
+	&dev_attr_idle_ns60_frames.attr,
+	&dev_attr_udfps_prestage.attr,
+	NULL
+};
+
+static const struct attribute_group ak3b_attr_group = {
+	.attrs = ak3b_attrs,
+};
+
+static void ak3b_cancel_work(void *data)
+{
+	struct ak3b_panel *spanel = data;
+
+	/* producers first, they re-arm the works cancelled after them */
+	cancel_work_sync(&spanel->udfps.work);
+	cancel_work_sync(&spanel->idle.boost_work);
+	ak3_brightness_cancel(&spanel->brt);
+	cancel_work_sync(&spanel->lhbm_cal_work);
+	cancel_delayed_work_sync(&spanel->idle.work);
+	cancel_delayed_work_sync(&spanel->udfps.gray_work);
+	cancel_work_sync(&spanel->deferred.work);
+	ak3b_cancel_display_on(spanel);
+}
+
+static void ak3b_touch_unregister(void *data)
+{
+	struct ak3b_panel *spanel = data;
+
+	input_unregister_handler(&spanel->idle.handler);
+	of_node_put(spanel->idle.touch_np);
+}
+
+/* boost the refresh rate on events of the touch device linked to the panel */
+static int ak3b_touch_register(struct ak3b_panel *spanel, struct device *dev)
+{
+	struct input_handler *handler = &spanel->idle.handler;
+	int ret;
+
+	spanel->idle.touch_np = of_parse_phandle(dev->of_node, "touch", 0);
+	if (!spanel->idle.touch_np) {
+		dev_info(dev, "no touch device, touch boost disabled\n");
+		return 0;
+	}
+
+	if (!of_property_read_u32(spanel->idle.touch_np, "goodix,udfps-x", &spanel->udfps.x) &&
+	    !of_property_read_u32(spanel->idle.touch_np, "goodix,udfps-y", &spanel->udfps.y))
+		spanel->udfps.has_location = true;
+	else
+		dev_info(dev, "no udfps location, LHBM pre-staging disabled\n");
+
+	handler->name = "ak3b_touch_boost";
+	handler->event = ak3b_touch_event;
+	handler->connect = ak3b_touch_connect;
+	handler->disconnect = ak3b_touch_disconnect;
+	handler->id_table = ak3b_touch_ids;
+	handler->private = spanel;
+
+	ret = input_register_handler(handler);
+	if (ret) {
+		of_node_put(spanel->idle.touch_np);
+		return ret;
+	}
+
+	return devm_add_action_or_reset(dev, ak3b_touch_unregister, spanel);
 }
 
 static int ak3b_panel_probe(struct mipi_dsi_device *dsi)
 {
 	struct ak3b_panel *spanel;
+	int ret;
 
 	spanel = devm_kzalloc(&dsi->dev, sizeof(*spanel), GFP_KERNEL);
 	if (!spanel)
 		return -ENOMEM;
 
 	spanel->base.op_hz = 120;
+	ak3_op_stats_init(&spanel->op_stats, ak3b_op_names, spanel->op_stat, AK3B_OP_MAX);
+
+	INIT_WORK(&spanel->lhbm_cal_work, ak3b_lhbm_cal_work);
+	ak3_brightness_init(&spanel->brt, &spanel->base, &ak3b_brightness_funcs);
+	INIT_DELAYED_WORK(&spanel->idle.work, ak3b_idle_work);
+	INIT_WORK(&spanel->idle.boost_work, ak3b_idle_boost_work);
+	INIT_WORK(&spanel->deferred.work, ak3b_deferred_work);
+	INIT_WORK(&spanel->udfps.work, ak3b_udfps_work);
+	INIT_DELAYED_WORK(&spanel->udfps.gray_work, ak3b_udfps_gray_work);
+	mutex_init(&spanel->udfps.gray_lock);
+	spin_lock_init(&spanel->udfps.lock);
+	spanel->udfps.down_slot = -1;
+	spanel->udfps.touch_slot = -1;
+	spanel->idle.hs60_frames = AK3B_IDLE_HS60_FRAMES;
+	spanel->idle.ns60_frames = AK3B_IDLE_NS60_FRAMES;
+	INIT_WORK(&spanel->display_on_work, ak3b_display_on_work);
+	ret = devm_add_action_or_reset(&dsi->dev, ak3b_cancel_work, spanel);
+	if (ret)
+		return ret;
+
+	ret = exynos_panel_common_init(dsi, &spanel->base);
+	if (ret)
+		return ret;
+
+	/* off the enable path, LHBM doesn't overdrive until the table is built */
+	ak3b_lhbm_od_lut_init(&spanel->base);
+
+	ret = ak3b_touch_register(spanel, &dsi->dev);
+	if (ret)
+		return ret;
+
+	return devm_device_add_group(&dsi->dev, &ak3b_attr_group);
+}
 
-	return exynos_panel_common_init(dsi, &spanel->base);
+static void ak3b_panel_remove(struct mipi_dsi_device *dsi)
+{
+	struct exynos_panel *ctx = mipi_dsi_get_drvdata(dsi);
+	struct ak3b_panel *spanel = to_spanel(ctx);
+
+	/*
+	 * The devm actions only run after the common teardown, stop the touch
+	 * events and the works before it.
+	 */
+	if (spanel->idle.touch_np)
+		devm_release_action(&dsi->dev, ak3b_touch_unregister, spanel);
+	ak3b_cancel_work(spanel);
+
+	exynos_panel_remove(dsi);
 }
 
 static void ak3b_set_ssc_mode(struct exynos_panel *exynos_panel,
@@ -1064,15 +2997,8 @@ static void ak3b_set_ssc_mode(struct exynos_panel *exynos_panel,
 		return;
 
 	exynos_panel->ssc_mode = ssc_mode;
-	EXYNOS_DCS_BUF_ADD(exynos_panel, 0xF0, 0x5A, 0x5A); /* test_key_on */
-	EXYNOS_DCS_BUF_ADD(exynos_panel, 0xFC, 0x5A, 0x5A); /* test_key_on */
-	EXYNOS_DCS_BUF_ADD(exynos_panel, 0xB0, 0x00, 0x6E, 0xC5); /* global para */
-	if (ssc_mode)
-		EXYNOS_DCS_BUF_ADD(exynos_panel, 0xC5, 0x07, 0x7F);
-	else
-		EXYNOS_DCS_BUF_ADD(exynos_panel, 0xC5, 0x04, 0x00);
-	EXYNOS_DCS_BUF_ADD(exynos_panel, 0xFC, 0xA5, 0xA5); /* test_key_off */
-	EXYNOS_DCS_BUF_ADD_AND_FLUSH(exynos_panel, 0xF0, 0xA5, 0xA5); /* test_key_off */
+	if (!ak3b_defer(exynos_panel, AK3B_DEFER_SSC))
+		ak3b_write_ssc(exynos_panel);
 	dev_info(exynos_panel->dev, "ssc_mode=%d \n", exynos_panel->ssc_mode);
 }
 
@@ -1184,7 +3110,7 @@ static const struct exynos_panel_mode ak3b_lp_mode = {
 
 static const struct drm_panel_funcs ak3b_drm_funcs = {
 	.disable = ak3b_disable,
-	.unprepare = exynos_panel_unprepare,
+	.unprepare = ak3b_unprepare,
 	.prepare = exynos_panel_prepare,
 	.enable = ak3b_enable,
 	.get_modes = exynos_panel_get_modes,
@@ -1192,7 +3118,7 @@ static const struct drm_panel_funcs ak3b_drm_funcs = {
 
 static const struct exynos_panel_funcs ak3b_exynos_funcs = {
 	.set_brightness = ak3b_set_brightness,
-	.set_lp_mode = exynos_panel_set_lp_mode,
+	.set_lp_mode = ak3b_set_lp_mode,
 	.set_nolp_mode = ak3b_set_nolp_mode,
 	.set_binned_lp = exynos_panel_set_binned_lp,
 	.set_hbm_mode = ak3b_set_hbm_mode,
@@ -1303,7 +3229,7 @@ MODULE_DEVICE_TABLE(of, exynos_panel_of_match);
 
 static struct mipi_dsi_driver exynos_panel_driver = {
 	.probe = ak3b_panel_probe,
-	.remove = exynos_panel_remove,
+	.remove = ak3b_panel_remove,
 	.driver = {
 		.name = "panel-google-ak3b",
 		.of_match_table = exynos_panel_of_match,